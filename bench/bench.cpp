@@ -0,0 +1,382 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "../include/more_dispatch/more_dispatch.h"
+
+// Benchmarks for dispatch throughput and latency.
+//
+// Build the bench target, then run it directly, or run the bench_json target
+// to write the results to bench.json. Any of Google Benchmark's flags work,
+// for example --benchmark_filter=ping_pong.
+
+namespace
+{
+	// Wait for a counter to reach a value, yielding so that the consumer
+	// gets to run even on a single core.
+	void wait_for(const std::atomic<int64_t>& counter, int64_t value)
+	{
+		while (counter.load(std::memory_order_acquire) < value)
+			std::this_thread::yield();
+	}
+
+	// A set of producer threads that each dispatch the same number of
+	// blocks whenever a round starts.
+	template <typename Queue> class producers
+	{
+		Queue& _queue;
+		std::atomic<int64_t>& _executed;
+		std::mutex _mutex;
+		std::condition_variable _start;
+		std::vector<std::thread> _threads;
+		int64_t _round = 0;
+		int64_t _blocks = 0;
+		bool _done = false;
+
+		void _run()
+		{
+			int64_t round = 0;
+			while (true) {
+				int64_t blocks;
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					while (_round == round && !_done)
+						_start.wait(lock);
+					if (_done) return;
+					round = _round;
+					blocks = _blocks;
+				}
+				std::atomic<int64_t>& executed = _executed;
+				for (int64_t i = 0; i < blocks; ++i)
+					_queue.dispatch([&executed] {
+						executed.fetch_add(1, std::memory_order_release);
+					});
+			}
+		}
+
+	public:
+		producers(Queue& queue, std::atomic<int64_t>& executed, int count)
+			: _queue(queue)
+			, _executed(executed)
+		{
+			for (int i = 0; i < count; ++i)
+				_threads.emplace_back([this] { _run(); });
+		}
+
+		// Have every producer dispatch the given number of blocks.
+		void start_round(int64_t blocks)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			++_round;
+			_blocks = blocks;
+			_start.notify_all();
+		}
+
+		~producers()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_done = true;
+				_start.notify_all();
+			}
+			for (auto& thread : _threads)
+				thread.join();
+		}
+	};
+
+	// A function whose size is exactly Size bytes, to sweep across the
+	// boundary between inline and out-of-line storage.
+	template <size_t Size> struct sized_function
+	{
+		static_assert(
+			Size > sizeof(void*), "Size must leave room for a payload");
+
+		std::atomic<int64_t>* executed;
+		char payload[Size - sizeof(void*)];
+
+		void operator()() const
+		{
+			executed->fetch_add(payload[0] + 1, std::memory_order_relaxed);
+		}
+	};
+} // namespace
+
+// Throughput from N producer threads into one consumer thread, including the
+// time for the consumer to run every block.
+template <typename Thread> void dispatch_throughput(benchmark::State& state)
+{
+	const int64_t per_round = 10000;
+	const int count = int(state.range(0));
+	std::atomic<int64_t> executed(0);
+	Thread thread;
+	producers<Thread> threads(thread, executed, count);
+	int64_t expected = 0;
+	for (auto _ : state) {
+		threads.start_round(per_round / count);
+		expected += per_round / count * count;
+		wait_for(executed, expected);
+	}
+	state.SetItemsProcessed(expected);
+}
+
+BENCHMARK_TEMPLATE(dispatch_throughput, more::dispatch_thread)
+	->ArgName("producers")
+	->Arg(1)
+	->Arg(2)
+	->Arg(4)
+	->Arg(8)
+	->UseRealTime();
+BENCHMARK_TEMPLATE(dispatch_throughput, more::ring_dispatch_thread)
+	->ArgName("producers")
+	->Arg(1)
+	->Arg(2)
+	->Arg(4)
+	->Arg(8)
+	->UseRealTime();
+
+// Throughput from one producer into a dispatch_thread with submission
+// caching, by cache threshold. Zero means caching is off.
+void cached_dispatch_throughput(benchmark::State& state)
+{
+	const int64_t per_round = 10000;
+	std::atomic<int64_t> executed(0);
+	more::dispatch_thread thread;
+	thread.cache_submissions(size_t(state.range(0)));
+	int64_t expected = 0;
+	for (auto _ : state) {
+		for (int64_t i = 0; i < per_round; ++i)
+			thread.dispatch([&executed] {
+				executed.fetch_add(1, std::memory_order_release);
+			});
+		thread.flush();
+		expected += per_round;
+		wait_for(executed, expected);
+	}
+	state.SetItemsProcessed(expected);
+}
+
+BENCHMARK(cached_dispatch_throughput)
+	->ArgName("threshold")
+	->Arg(0)
+	->Arg(16)
+	->Arg(64)
+	->Arg(256)
+	->UseRealTime();
+
+// Throughput into several dispatch_threads that sit next to each other in
+// an array, each with its own producer. Without padding, neighbouring queues
+// and each queue's producer and consumer share cache lines. Compare with
+// bench_unpadded, which is built with MORE_DISPATCH_CACHE_LINE=1.
+void dispatch_thread_array(benchmark::State& state)
+{
+	const int64_t per_round = 10000;
+	const int count = int(state.range(0));
+	struct alignas(128) counter
+	{
+		std::atomic<int64_t> executed;
+	};
+	counter executed[4];
+	more::dispatch_thread threads[4];
+	std::vector<std::unique_ptr<producers<more::dispatch_thread>>> feeds;
+	for (int i = 0; i < count; ++i) {
+		executed[i].executed = 0;
+		feeds.emplace_back(new producers<more::dispatch_thread>(
+			threads[i], executed[i].executed, 1));
+	}
+	int64_t expected = 0;
+	for (auto _ : state) {
+		for (auto& feed : feeds)
+			feed->start_round(per_round);
+		expected += per_round;
+		for (int i = 0; i < count; ++i)
+			wait_for(executed[i].executed, expected);
+	}
+	state.SetItemsProcessed(expected * count);
+}
+
+BENCHMARK(dispatch_thread_array)
+	->ArgName("threads")
+	->Arg(1)
+	->Arg(2)
+	->Arg(4)
+	->UseRealTime();
+
+// Round trip latency: a block on one thread dispatches a block to another,
+// which dispatches one back, and so on. Each iteration is one round trip.
+template <typename Thread> void ping_pong(benchmark::State& state)
+{
+	const int64_t trips = 1000;
+	Thread a;
+	Thread b;
+	std::atomic<int64_t> done(0);
+	std::function<void(int64_t)> ping;
+	std::function<void(int64_t)> pong;
+	ping = [&](int64_t left) {
+		if (left == 0) done.fetch_add(1, std::memory_order_release);
+		else b.dispatch([&, left] { pong(left); });
+	};
+	pong = [&](int64_t left) { a.dispatch([&, left] { ping(left - 1); }); };
+
+	int64_t rounds = 0;
+	while (state.KeepRunningBatch(trips)) {
+		a.dispatch([&] { ping(trips); });
+		wait_for(done, ++rounds);
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_TEMPLATE(ping_pong, more::dispatch_thread)->UseRealTime();
+BENCHMARK_TEMPLATE(ping_pong, more::ring_dispatch_thread)->UseRealTime();
+
+// The cost to dispatch and run a block, depending on the size of its
+// function. This is single-threaded, so it measures just the storage:
+// inline, arena or heap.
+template <size_t Size> void capture_size(benchmark::State& state)
+{
+	const int64_t batch = 256;
+	std::atomic<int64_t> executed(0);
+	more::dispatch_queue queue;
+	sized_function<Size> function;
+	function.executed = &executed;
+	function.payload[0] = 0;
+	queue.reserve(batch);
+	size_t heap_before = more::dispatch_block::heap_allocations();
+	while (state.KeepRunningBatch(batch)) {
+		for (int64_t i = 0; i < batch; ++i)
+			queue.dispatch(function);
+		queue.run_once();
+	}
+	state.SetItemsProcessed(state.iterations());
+	state.counters["bytes"] = double(Size);
+	state.counters["inline"] =
+		more::dispatch_block::heap_allocations() == heap_before;
+	queue.stop();
+}
+
+BENCHMARK_TEMPLATE(capture_size, 16);
+BENCHMARK_TEMPLATE(capture_size, 24);
+BENCHMARK_TEMPLATE(capture_size, 32);
+BENCHMARK_TEMPLATE(capture_size, 40);
+BENCHMARK_TEMPLATE(capture_size, 64);
+BENCHMARK_TEMPLATE(capture_size, 128);
+BENCHMARK_TEMPLATE(capture_size, 512);
+BENCHMARK_TEMPLATE(capture_size, 4096);
+BENCHMARK_TEMPLATE(capture_size, 8192);
+
+// The cost per block of run_once(), depending on how many blocks it finds
+// waiting: each call takes the lock once for the whole batch.
+void run_once_batch(benchmark::State& state)
+{
+	const int64_t batch = state.range(0);
+	std::atomic<int64_t> executed(0);
+	more::dispatch_queue queue;
+	queue.reserve(size_t(batch));
+	while (state.KeepRunningBatch(batch)) {
+		for (int64_t i = 0; i < batch; ++i)
+			queue.dispatch([&executed] {
+				executed.fetch_add(1, std::memory_order_relaxed);
+			});
+		queue.run_once();
+	}
+	state.SetItemsProcessed(state.iterations());
+	queue.stop();
+}
+
+BENCHMARK(run_once_batch)
+	->ArgName("batch")
+	->RangeMultiplier(4)
+	->Range(1, 4096);
+
+// Reference fork/join workloads: a parallel sum and sort of a million
+// ints, on a pool of the given size, against std::sort on one thread.
+std::vector<int> shuffled_ints(size_t n)
+{
+	std::vector<int> values(n);
+	uint64_t x = 88172645463325252ull;
+	for (int& v : values) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		v = int(x >> 33);
+	}
+	return values;
+}
+
+void parallel_reduce_sum(benchmark::State& state)
+{
+	more::dispatch_pool pool(size_t(state.range(0)));
+	std::vector<int> values = shuffled_ints(1 << 20);
+	for (auto _ : state) {
+		int64_t sum = more::parallel_reduce(
+			pool,
+			values.begin(),
+			values.end(),
+			int64_t(0),
+			[](int64_t a, int64_t b) { return a + b; });
+		benchmark::DoNotOptimize(sum);
+	}
+	state.SetItemsProcessed(state.iterations() * int64_t(values.size()));
+}
+
+BENCHMARK(parallel_reduce_sum)
+	->ArgName("threads")
+	->Arg(1)
+	->Arg(2)
+	->Arg(4)
+	->UseRealTime();
+
+void parallel_sort_ints(benchmark::State& state)
+{
+	more::dispatch_pool pool(size_t(state.range(0)));
+	const std::vector<int> input = shuffled_ints(1 << 20);
+	std::vector<int> values;
+	for (auto _ : state) {
+		state.PauseTiming();
+		values = input;
+		state.ResumeTiming();
+		if (state.range(0) == 0) std::sort(values.begin(), values.end());
+		else more::parallel_sort(pool, values.begin(), values.end());
+	}
+	state.SetItemsProcessed(state.iterations() * int64_t(input.size()));
+}
+
+BENCHMARK(parallel_sort_ints)
+	->ArgName("threads")
+	->Arg(0) // std::sort
+	->Arg(1)
+	->Arg(2)
+	->Arg(4)
+	->UseRealTime();
+
+// Three stages, a value at a time, with the middle one on the given number
+// of threads.
+void pipeline_handoff(benchmark::State& state)
+{
+	const int values = 1 << 16;
+	int64_t sum = 0;
+	for (auto _ : state) {
+		auto p = more::make_pipeline<int>(
+			1024,
+			more::idle_policy::low_latency(),
+			more::serial_stage([](int i) { return int64_t(i); }),
+			more::parallel_stage(
+				size_t(state.range(0)), [](int64_t i) { return i * 3; }),
+			more::serial_stage([&](int64_t i) { sum += i; }));
+		for (int i = 0; i < values; ++i)
+			p.push(i);
+		p.close();
+	}
+	benchmark::DoNotOptimize(sum);
+	state.SetItemsProcessed(state.iterations() * values);
+}
+
+BENCHMARK(pipeline_handoff)->ArgName("threads")->Arg(1)->Arg(2)->UseRealTime();
+
+BENCHMARK_MAIN();
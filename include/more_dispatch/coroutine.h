@@ -0,0 +1,284 @@
+#ifndef more_dispatch_coroutine_h
+#define more_dispatch_coroutine_h
+
+// C++20 coroutine support for more_dispatch.h.
+//
+// co_await queue.schedule() suspends the calling coroutine and resumes it on
+// the queue (or dispatch_thread, dispatch_pool or serial_queue). The block
+// that resumes it holds nothing but the coroutine_handle, so it's stored
+// inline, moved with a memcpy, and a thread hop costs one pointer-sized
+// dispatch with no allocation.
+//
+// The co_await evaluates to true if the coroutine was resumed on the queue,
+// or false if the queue was stopped, in which case the coroutine carries on
+// where it is. If a queue is destroyed, or drops a block because it's full,
+// before the block runs, the coroutine is never resumed.
+//
+// task<T> is a lazily started coroutine that returns a T. It starts running
+// when it's awaited, and resumes the awaiting coroutine when it finishes,
+// rethrowing any exception. sync_wait() runs a task from ordinary code and
+// blocks until it has finished.
+
+#include "more_dispatch.h"
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+
+namespace more
+{
+	template <typename T = void> class task;
+
+	namespace detail
+	{
+		// The function in the block that resumes a coroutine.
+		struct resume_function
+		{
+			std::coroutine_handle<> handle;
+
+			void operator()() const { handle.resume(); }
+		};
+
+		static_assert(
+			dispatch_block::fits_inline<resume_function>::value
+				&& dispatch_block::trivially_relocatable<
+					resume_function>::value,
+			"resuming a coroutine should never allocate");
+
+		template <typename Queue> struct schedule_awaitable
+		{
+			Queue& queue;
+			bool scheduled = false;
+
+			explicit schedule_awaitable(Queue& queue) : queue(queue) {}
+
+			bool await_ready() const noexcept { return false; }
+
+			// Once the block is dispatched, the coroutine might be resumed,
+			// and this awaitable destroyed, at any moment. So we set
+			// scheduled first, and only touch it again if dispatching fails.
+			bool await_suspend(std::coroutine_handle<> handle)
+			{
+				scheduled = true;
+				if (queue.dispatch(resume_function { handle })) return true;
+				scheduled = false;
+				return false;
+			}
+
+			bool await_resume() const noexcept { return scheduled; }
+		};
+
+		struct task_promise_base
+		{
+			std::coroutine_handle<> continuation = std::noop_coroutine();
+			std::exception_ptr error;
+
+			// When the task finishes, transfer straight to whoever was
+			// awaiting it, without growing the stack.
+			struct final_awaiter
+			{
+				bool await_ready() const noexcept { return false; }
+
+				template <typename Promise>
+				std::coroutine_handle<>
+				await_suspend(std::coroutine_handle<Promise> handle) noexcept
+				{
+					return handle.promise().continuation;
+				}
+
+				void await_resume() const noexcept {}
+			};
+
+			std::suspend_always initial_suspend() const noexcept { return {}; }
+			final_awaiter final_suspend() const noexcept { return {}; }
+			void unhandled_exception() { error = std::current_exception(); }
+
+			void rethrow() const
+			{
+				if (error) std::rethrow_exception(error);
+			}
+		};
+
+		template <typename T> struct task_promise : task_promise_base
+		{
+			std::optional<T> value;
+
+			task<T> get_return_object();
+
+			template <typename U> void return_value(U&& v)
+			{
+				value.emplace(std::forward<U>(v));
+			}
+
+			T result()
+			{
+				rethrow();
+				return std::move(*value);
+			}
+		};
+
+		template <> struct task_promise<void> : task_promise_base
+		{
+			task<void> get_return_object();
+
+			void return_void() {}
+			void result() { rethrow(); }
+		};
+	} // namespace detail
+
+	// A coroutine that returns a T, and doesn't start until it's awaited.
+	// A task can be awaited once.
+	template <typename T> class task
+	{
+	public:
+		typedef detail::task_promise<T> promise_type;
+
+	private:
+		std::coroutine_handle<promise_type> _handle;
+
+		explicit task(std::coroutine_handle<promise_type> handle)
+			: _handle(handle)
+		{
+		}
+
+		friend promise_type;
+
+	public:
+		task() : _handle(nullptr) {}
+
+		task(task&& other) noexcept : _handle(other._handle)
+		{
+			other._handle = nullptr;
+		}
+
+		task& operator=(task&& other) noexcept
+		{
+			if (this != &other) {
+				if (_handle) _handle.destroy();
+				_handle = other._handle;
+				other._handle = nullptr;
+			}
+			return *this;
+		}
+
+		task(const task&) = delete;
+		task& operator=(const task&) = delete;
+
+		~task()
+		{
+			if (_handle) _handle.destroy();
+		}
+
+		// Whether the task holds a coroutine.
+		bool valid() const { return bool(_handle); }
+
+		struct awaiter
+		{
+			std::coroutine_handle<promise_type> handle;
+
+			bool await_ready() const noexcept { return handle.done(); }
+
+			std::coroutine_handle<>
+			await_suspend(std::coroutine_handle<> awaiting) noexcept
+			{
+				handle.promise().continuation = awaiting;
+				return handle;
+			}
+
+			T await_resume() { return handle.promise().result(); }
+		};
+
+		awaiter operator co_await() const noexcept
+		{
+			assert(_handle);
+			return awaiter { _handle };
+		}
+	};
+
+	namespace detail
+	{
+		template <typename T> task<T> task_promise<T>::get_return_object()
+		{
+			return task<T>(
+				std::coroutine_handle<task_promise<T>>::from_promise(*this));
+		}
+
+		inline task<void> task_promise<void>::get_return_object()
+		{
+			return task<void>(
+				std::coroutine_handle<task_promise<void>>::from_promise(*this));
+		}
+
+		// A coroutine that starts straight away and frees itself when it
+		// finishes.
+		struct detached_task
+		{
+			struct promise_type
+			{
+				detached_task get_return_object() const noexcept { return {}; }
+				std::suspend_never initial_suspend() const noexcept
+				{
+					return {};
+				}
+				std::suspend_never final_suspend() const noexcept
+				{
+					return {};
+				}
+				void return_void() const noexcept {}
+				void unhandled_exception() const noexcept { std::terminate(); }
+			};
+		};
+
+		template <typename T> struct sync_wait_state
+		{
+			std::mutex mutex;
+			std::condition_variable cond;
+			bool done = false;
+			std::optional<T> value;
+			std::exception_ptr error;
+		};
+
+		template <> struct sync_wait_state<void>
+		{
+			std::mutex mutex;
+			std::condition_variable cond;
+			bool done = false;
+			std::exception_ptr error;
+		};
+
+		template <typename T>
+		detached_task run_and_notify(task<T>& t, sync_wait_state<T>& state)
+		{
+			try {
+				if constexpr (std::is_void_v<T>) co_await t;
+				else state.value.emplace(co_await t);
+			} catch (...) {
+				state.error = std::current_exception();
+			}
+
+			// Notify with the lock held: once it's released, the waiter may
+			// destroy the state.
+			std::lock_guard<std::mutex> lock(state.mutex);
+			state.done = true;
+			state.cond.notify_all();
+		}
+	} // namespace detail
+
+	// Run a task on the calling thread until it first suspends, then block
+	// until it has finished. Returns its result, or rethrows its exception.
+	// Don't call this from a block on a queue that the task needs.
+	template <typename T> T sync_wait(task<T> t)
+	{
+		detail::sync_wait_state<T> state;
+		detail::run_and_notify(t, state);
+		{
+			std::unique_lock<std::mutex> lock(state.mutex);
+			while (!state.done)
+				state.cond.wait(lock);
+		}
+		if (state.error) std::rethrow_exception(state.error);
+		if constexpr (!std::is_void_v<T>) return std::move(*state.value);
+	}
+} // namespace more
+
+#endif // more_dispatch_coroutine_h
@@ -2,217 +2,5716 @@
 #define more_dispatch_h
 
 #include <assert.h>
+#include <stdint.h>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+#if defined(_WIN32)
+// Keep windows.h from defining min() and max() macros, which would break
+// std::min and std::max, and from pulling in more than we need.
+#ifndef NOMINMAX
+#define NOMINMAX
+#define MORE_DISPATCH_UNDEF_NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#define MORE_DISPATCH_UNDEF_WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#ifdef MORE_DISPATCH_UNDEF_NOMINMAX
+#undef NOMINMAX
+#undef MORE_DISPATCH_UNDEF_NOMINMAX
+#endif
+#ifdef MORE_DISPATCH_UNDEF_WIN32_LEAN_AND_MEAN
+#undef WIN32_LEAN_AND_MEAN
+#undef MORE_DISPATCH_UNDEF_WIN32_LEAN_AND_MEAN
+#endif
+#elif defined(__APPLE__)
+#include <errno.h>
+#include <pthread.h>
+#include <sys/event.h>
+#include <sys/qos.h>
+#include <unistd.h>
+#elif defined(__linux__)
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iterator>
 #include <memory>
 #include <mutex>
 #include <queue>
+#include <string>
+#include <system_error>
 #include <thread>
+#include <type_traits>
 #include <utility>
+#include <vector>
+
+// Define MORE_DISPATCH_METRICS to 1 to have dispatch_queue keep counters and
+// latency histograms. It's off by default, and then costs nothing.
+#ifndef MORE_DISPATCH_METRICS
+#define MORE_DISPATCH_METRICS 0
+#endif
+
+// Define MORE_DISPATCH_TRACING to 1 to be able to trace blocks from the
+// thread that dispatched them to the thread that ran them. See below.
+#ifndef MORE_DISPATCH_TRACING
+#define MORE_DISPATCH_TRACING 0
+#endif
+
+#if MORE_DISPATCH_METRICS || MORE_DISPATCH_TRACING
+#include <stdio.h>
+#endif
 
 namespace more
 {
 	// -------------------------------------------------------------------------
 	// dispatch_block: container for any no-args function returning void.
 	// These are the objects that you can send to a dispatch queue.
+	//
+	// A block stores its function inline, in a fixed amount of space. If the
+	// function is too large (or too strictly aligned) to fit, it's moved to
+	// the heap instead, and the block just holds a pointer to it. Blocks made
+	// by a queue's dispatch() go into that queue's block_arena rather than
+	// the general heap, if they're not too big for it.
+	//
+	// There's no vtable. A block holds a pointer to a table of operations
+	// for its function type, so running and destroying a block is a single
+	// indirect call, and moving a block whose function is trivially copyable
+	// (or stored out of line) is just a memcpy.
+	//
+	// A block owns its function, and everything the function captured. A
+	// moved-from block is empty, as is a default-constructed one. The queues
+	// run each block with invoke_and_destroy(), so its captures are released
+	// as soon as it has run, not when the rest of its batch has.
+	//
+	// The inline size is a template parameter of basic_dispatch_block. The
+	// dispatch_block type used by the queues below has room for four
+	// pointers, which can be changed by defining MORE_DISPATCH_INLINE_SIZE.
+	// Define MORE_DISPATCH_HEAP_FALLBACK to 0 to make oversized functions a
+	// compile error instead.
 
-	struct movable_function_base
+	namespace detail
 	{
-		virtual void invoke() = 0;
-		virtual void move_to(void* dest, size_t size) = 0;
-		virtual ~movable_function_base() = default;
-	};
+		// The operations a block needs on the function it holds. There's one
+		// table for each function type and way of storing it, so a block is
+		// just a pointer to its table plus some storage.
+		struct block_ops
+		{
+			// Call the function.
+			void (*invoke)(void* space);
 
-	template <typename F> struct movable_function : public movable_function_base
-	{
-		F _function;
+			// Call the function, then destroy it, in one indirect call.
+			void (*invoke_and_destroy)(void* space);
 
-		movable_function(F&& function) : _function(std::move(function)) {}
+			// Move the function to another block's storage, and destroy the
+			// original. Null if copying the bytes will do.
+			void (*relocate)(void* dest, void* src);
 
-		virtual void invoke() { _function(); }
+			// Destroy the function. Null if there's nothing to do.
+			void (*destroy)(void* space);
+		};
 
-		virtual void move_to(void* dest, size_t size)
+		// A function stored inside the block. If it's trivially copyable,
+		// moving the block is a plain memcpy.
+		template <typename F> struct inline_storage
 		{
-			assert(size >= sizeof(*this));
-			new (dest) movable_function(std::move(*this));
-		}
+			static F& get(void* space) { return *static_cast<F*>(space); }
+
+			template <typename G> static void construct(void* space, G&& f)
+			{
+				new (space) F(std::forward<G>(f));
+			}
+
+			static void invoke(void* space) { get(space)(); }
+
+			static void invoke_and_destroy(void* space)
+			{
+				F& f = get(space);
+				f();
+				f.~F();
+			}
+
+			static void relocate(void* dest, void* src)
+			{
+				F& f = get(src);
+				new (dest) F(std::move(f));
+				f.~F();
+			}
+
+			static void destroy(void* space) { get(space).~F(); }
+
+			static const block_ops ops;
+		};
+
+		template <typename F>
+		const block_ops inline_storage<F>::ops = {
+			&inline_storage<F>::invoke,
+			&inline_storage<F>::invoke_and_destroy,
+			std::is_trivially_copyable<F>::value
+				? nullptr
+				: &inline_storage<F>::relocate,
+			std::is_trivially_destructible<F>::value
+				? nullptr
+				: &inline_storage<F>::destroy,
+		};
+
+		// A function stored on the heap, respecting its alignment. The block
+		// holds a pointer to it, so moving the block is a memcpy.
+		template <typename F> struct boxed_storage
+		{
+			typedef std::integral_constant<
+				bool,
+				(alignof(F) > alignof(std::max_align_t))>
+				over_aligned;
+
+			static F*& get(void* space) { return *static_cast<F**>(space); }
+
+			template <typename G> static void construct(void* space, G&& f)
+			{
+				new (space) F*(_allocate(std::forward<G>(f), over_aligned()));
+			}
+
+			static void invoke(void* space) { (*get(space))(); }
+
+			static void invoke_and_destroy(void* space)
+			{
+				F* f = get(space);
+				(*f)();
+				_free(f, over_aligned());
+			}
+
+			static void destroy(void* space)
+			{
+				_free(get(space), over_aligned());
+			}
+
+			static const block_ops ops;
+
+		private:
+			template <typename G>
+			static F* _allocate(G&& function, std::false_type)
+			{
+				return new F(std::forward<G>(function));
+			}
+
+			static void _free(F* function, std::false_type) { delete function; }
+
+			// Allocate enough to align the function, plus room just before it
+			// for the pointer we need to free.
+			template <typename G>
+			static F* _allocate(G&& function, std::true_type)
+			{
+				size_t size = sizeof(F) + alignof(F) + sizeof(void*);
+				char* raw = static_cast<char*>(::operator new(size));
+				uintptr_t p = uintptr_t(raw + sizeof(void*));
+				p = (p + alignof(F) - 1) & ~uintptr_t(alignof(F) - 1);
+				reinterpret_cast<void**>(p)[-1] = raw;
+				void* dest = reinterpret_cast<void*>(p);
+				return new (dest) F(std::forward<G>(function));
+			}
+
+			static void _free(F* function, std::true_type)
+			{
+				void* raw = reinterpret_cast<void**>(function)[-1];
+				function->~F();
+				::operator delete(raw);
+			}
+		};
+
+		template <typename F>
+		const block_ops boxed_storage<F>::ops = {
+			&boxed_storage<F>::invoke,
+			&boxed_storage<F>::invoke_and_destroy,
+			nullptr,
+			&boxed_storage<F>::destroy,
+		};
+	} // namespace detail
+
+	// -------------------------------------------------------------------------
+	// block_arena: slab storage for functions too large to store inline.
+	//
+	// Each queue has its own arena, with a slab pool for each power-of-two
+	// size class from 64 bytes to 4 KiB. Producers allocate from the arena;
+	// consumers free back to it with a single compare-and-swap, onto a list
+	// that the next allocation takes over in one go. So blocks that are made
+	// on one thread and destroyed on another don't contend in malloc, and
+	// after warming up, dispatching a large block doesn't allocate at all.
+	//
+	// Functions that are bigger than 4 KiB, or over-aligned, still go to the
+	// heap. Slabs are never freed until the arena is destroyed.
+
+	struct arena_stats
+	{
+		size_t reserved; // Bytes of slabs allocated.
+		size_t in_use; // Bytes of slots holding a function right now.
+		size_t allocations; // Slots handed out, in total.
 	};
 
-	struct dispatch_block : public movable_function_base
+	class block_arena
 	{
-		void* _space[4];
+	public:
+		static const size_t min_size = 64;
+		static const size_t classes = 7;
+		static const size_t max_size = min_size << (classes - 1);
+
+		// The size class for an object of the given size.
+		static constexpr size_t size_class(size_t size, size_t c = 0)
+		{
+			return c == classes || size <= (min_size << c)
+				? c
+				: size_class(size, c + 1);
+		}
+
+		// Whether a function of type F can be stored in an arena.
+		template <typename F> struct fits
+		{
+			static const bool value = sizeof(F) <= max_size
+				&& alignof(F) <= alignof(std::max_align_t);
+		};
+
+	private:
+		union slot
+		{
+			slot* next;
+			std::max_align_t align;
+		};
+
+		struct pool
+		{
+			std::mutex mutex; // Guards free.
+			slot* free = nullptr; // Slots ready for allocation.
+			std::atomic<slot*> returned; // Slots freed since.
+
+			pool() : returned(nullptr) {}
+		};
 
-		dispatch_block() = delete;
-		dispatch_block(const dispatch_block&) = delete;
+		static const size_t slab_size = 16 * 1024;
 
-		dispatch_block(dispatch_block&& other)
+		pool _pools[classes];
+		std::mutex _mutex; // Guards _slabs.
+		std::vector<std::unique_ptr<std::max_align_t[]>> _slabs;
+		std::atomic<size_t> _reserved;
+		std::atomic<size_t> _in_use;
+		std::atomic<size_t> _allocations;
+
+		// Carve a new slab into a list of slots.
+		slot* _new_slab(size_t size)
 		{
-			other.move_to(this, sizeof(*this));
+			size_t count = std::max<size_t>(slab_size / size, 8);
+			size_t words = count * size / sizeof(std::max_align_t);
+			std::unique_ptr<std::max_align_t[]> slab(
+				new std::max_align_t[words]);
+
+			char* base = reinterpret_cast<char*>(slab.get());
+			for (size_t i = 0; i < count; ++i) {
+				slot* s = reinterpret_cast<slot*>(base + i * size);
+				s->next = i + 1 < count
+					? reinterpret_cast<slot*>(base + (i + 1) * size)
+					: nullptr;
+			}
+			_reserved.fetch_add(count * size, std::memory_order_relaxed);
+
+			std::lock_guard<std::mutex> lock(_mutex);
+			_slabs.push_back(std::move(slab));
+			return reinterpret_cast<slot*>(base);
 		}
 
-		dispatch_block(movable_function_base&& other)
+	public:
+		block_arena()
+			: _reserved(0)
+			, _in_use(0)
+			, _allocations(0)
 		{
-			other.move_to(this, sizeof(*this));
 		}
 
-		virtual void move_to(void* dest, size_t size) { assert(false); }
+		block_arena(const block_arena&) = delete;
+		block_arena& operator=(const block_arena&) = delete;
 
-		virtual void invoke() { assert(false); }
+		// Allocate a slot of the given size class.
+		void* allocate(size_t c)
+		{
+			assert(c < classes);
+			size_t size = min_size << c;
+			pool& p = _pools[c];
+			slot* s;
+			{
+				std::lock_guard<std::mutex> lock(p.mutex);
+				if (!p.free)
+					p.free = p.returned.exchange(
+						nullptr, std::memory_order_acquire);
+				if (!p.free) p.free = _new_slab(size);
+				s = p.free;
+				p.free = s->next;
+			}
+			_in_use.fetch_add(size, std::memory_order_relaxed);
+			_allocations.fetch_add(1, std::memory_order_relaxed);
+			return s;
+		}
 
-		void operator()() { invoke(); }
+		// Give a slot back. This is lock-free, and may be called from any
+		// thread.
+		void deallocate(void* p, size_t c)
+		{
+			assert(c < classes);
+			slot* s = static_cast<slot*>(p);
+			std::atomic<slot*>& returned = _pools[c].returned;
+			s->next = returned.load(std::memory_order_relaxed);
+			while (!returned.compare_exchange_weak(
+				s->next, s, std::memory_order_release))
+				;
+			_in_use.fetch_sub(min_size << c, std::memory_order_relaxed);
+		}
+
+		arena_stats stats() const
+		{
+			arena_stats stats;
+			stats.reserved = _reserved.load(std::memory_order_relaxed);
+			stats.in_use = _in_use.load(std::memory_order_relaxed);
+			stats.allocations = _allocations.load(std::memory_order_relaxed);
+			return stats;
+		}
 	};
 
+#if MORE_DISPATCH_TRACING
 	// -------------------------------------------------------------------------
-	// dispatch_queue: receives blocks, executes them in FIFO order.
-	//
-	// Call dispatch() to add a block to the queue.
-	// Call run_once() or run_forever() to execute queued blocks.
-	// Call stop() to stop accepting new blocks.
-	// Call wait_until_done() to wait until the queue is empty.
+	// Tracing: records when each block was dispatched, and when and on which
+	// thread it ran, as a flow from the producer to the consumer.
 	//
-	// All methods are thread-safe. However, to ensure that blocks are
-	// executed in strict FIFO order, only one thread should call run_*().
+	// This only exists if MORE_DISPATCH_TRACING is defined to 1. Even then,
+	// nothing is recorded until trace_sampling() is called: trace_sampling(1)
+	// traces every block, and trace_sampling(100) one block in a hundred per
+	// producer thread, which is cheap enough to leave on in production. An
+	// untraced block costs one relaxed load when it's dispatched.
 	//
-	// Normally it's easier to use dispatch_thread (below) which handles
-	// threading automatically. This class is useful for integrating into an
-	// existing thread; just call run_once() from your inner loop.
+	// Blocks are traced when they're dispatched to a queue, a pool or a
+	// dispatch_thread, but not when they're added to a dispatch_batch or a
+	// submission cache.
+	// A traced block gets a flow id, and calls the trace_hooks when it's
+	// dispatched, when it starts running and when it finishes.
 	//
-	// The destructor calls stop() and wait_until_done(). Beware that this may
-	// deadlock unless another thread is calling run_once() or run_forever().
-	// (Alternatively, you could call stop() and run_forever() on your main
-	// thread to flush out the queue before destroying it.)
+	// The default hooks append events to a fixed-size buffer for each thread,
+	// without locking, and stop recording when it's full. Call
+	// write_chrome_trace() to write every thread's events as Chrome trace
+	// JSON, which chrome://tracing and ui.perfetto.dev can load.
 
-	class dispatch_queue
+#ifndef MORE_DISPATCH_TRACE_EVENTS
+#define MORE_DISPATCH_TRACE_EVENTS (1u << 15) // Per thread.
+#endif
+
+	struct trace_hooks
 	{
-		std::mutex _mutex;
-		std::condition_variable _cond;
-		bool _done = false;
-		std::vector<dispatch_block> _queue;
+		void (*dispatched)(uint64_t flow);
+		void (*started)(uint64_t flow);
+		void (*finished)(uint64_t flow);
+	};
 
-		bool _dispatch(dispatch_block&& block)
+	namespace detail
+	{
+		enum class trace_kind : uint32_t
 		{
-			std::lock_guard<std::mutex> lock(_mutex);
-			if (_done) return false;
+			dispatched,
+			started,
+			finished,
+		};
 
-			_queue.push_back(std::move(block));
-			_cond.notify_all();
-			return true;
+		struct trace_event
+		{
+			uint64_t time; // Nanoseconds since the tracer started.
+			uint64_t flow;
+			trace_kind kind;
+		};
+
+		// One thread's events. Only that thread appends to it, and it
+		// publishes each event by bumping size, so a reader can take a
+		// consistent prefix at any time.
+		struct trace_buffer
+		{
+			static const size_t capacity = MORE_DISPATCH_TRACE_EVENTS;
+
+			trace_event events[capacity];
+			std::atomic<size_t> size;
+			unsigned tid;
+			std::string name; // Guarded by the tracer's mutex.
+
+			explicit trace_buffer(unsigned tid) : size(0), tid(tid) {}
+
+			void append(trace_kind kind, uint64_t time, uint64_t flow)
+			{
+				size_t n = size.load(std::memory_order_relaxed);
+				if (n == capacity) return;
+				events[n].time = time;
+				events[n].flow = flow;
+				events[n].kind = kind;
+				size.store(n + 1, std::memory_order_release);
+			}
+		};
+
+		inline const trace_hooks* default_trace_hooks();
+
+		struct tracer
+		{
+			std::atomic<unsigned> sampling;
+			std::atomic<uint64_t> next_flow;
+			std::atomic<const trace_hooks*> hooks;
+			std::chrono::steady_clock::time_point start;
+
+			// Every thread's buffer. The buffers are never freed, so that
+			// the events of threads that have exited can still be written.
+			std::mutex mutex;
+			std::vector<trace_buffer*> buffers;
+
+			tracer()
+				: sampling(0)
+				, next_flow(1)
+				, hooks(default_trace_hooks())
+				, start(std::chrono::steady_clock::now())
+			{
+			}
+
+			// The tracer is never destroyed, so any thread can trace at any
+			// time.
+			static tracer& get()
+			{
+				static tracer* t = new tracer;
+				return *t;
+			}
+
+			static trace_buffer& buffer()
+			{
+				static thread_local trace_buffer* b = nullptr;
+				if (!b) {
+					tracer& t = get();
+					std::lock_guard<std::mutex> lock(t.mutex);
+					b = new trace_buffer(unsigned(t.buffers.size() + 1));
+					t.buffers.push_back(b);
+				}
+				return *b;
+			}
+
+			uint64_t now() const
+			{
+				auto t = std::chrono::steady_clock::now() - start;
+				return uint64_t(
+					std::chrono::duration_cast<std::chrono::nanoseconds>(t)
+						.count());
+			}
+		};
+
+		inline void record(trace_kind kind, uint64_t flow)
+		{
+			tracer::buffer().append(kind, tracer::get().now(), flow);
 		}
 
-	public:
-		// Queue a lambda expression or functor for execution.
-		// Returns true on success, false if the queue is stopped.
-		template <typename F> bool dispatch(F&& lambda)
+		inline void record_dispatched(uint64_t flow)
 		{
-			movable_function<F> function(std::move(lambda));
-			return _dispatch(std::move(function));
+			record(trace_kind::dispatched, flow);
 		}
 
-		// Stop accepting new blocks. dispatch() will now return false.
-		// This method is idempotent; it's safe to call it multiple times.
-		void stop()
+		inline void record_started(uint64_t flow)
 		{
-			std::lock_guard<std::mutex> lock(_mutex);
-			_done = true;
-			_cond.notify_all();
+			record(trace_kind::started, flow);
 		}
 
-		// Wait until the queue is stopped and all outstanding blocks have run.
-		void wait_until_done()
+		inline void record_finished(uint64_t flow)
 		{
-			std::unique_lock<std::mutex> lock(_mutex);
-			while (!_done || !_queue.empty())
-				_cond.wait(lock);
+			record(trace_kind::finished, flow);
 		}
 
-		// Grab some blocks from the queue, if any are available, and run them.
-		void run_once()
+		inline const trace_hooks* default_trace_hooks()
 		{
-			std::vector<dispatch_block> q;
+			static const trace_hooks hooks = {
+				&record_dispatched,
+				&record_started,
+				&record_finished,
+			};
+			return &hooks;
+		}
+
+		// Decide whether to trace a block that's being dispatched. If so,
+		// give it a flow id and call the dispatched hook.
+		inline uint64_t trace_dispatch()
+		{
+			tracer& t = tracer::get();
+			unsigned sampling = t.sampling.load(std::memory_order_relaxed);
+			if (sampling == 0) return 0;
+			static thread_local unsigned countdown = 0;
+			if (countdown > 0) {
+				--countdown;
+				return 0;
+			}
+			countdown = sampling - 1;
+			uint64_t flow = t.next_flow.fetch_add(1, std::memory_order_relaxed);
+			t.hooks.load(std::memory_order_acquire)->dispatched(flow);
+			return flow;
+		}
+
+		// A function that calls the started and finished hooks around
+		// itself.
+		template <typename F> struct traced_function
+		{
+			F function;
+			uint64_t flow;
+
+			template <typename G>
+			traced_function(G&& f, uint64_t flow)
+				: function(std::forward<G>(f))
+				, flow(flow)
 			{
-				std::lock_guard<std::mutex> lock(_mutex);
-				std::swap(q, _queue);
 			}
-			if (q.empty() && _done) {
-				_cond.notify_all();
-				return;
+
+			void operator()()
+			{
+				struct scope
+				{
+					const trace_hooks* hooks;
+					uint64_t flow;
+					~scope() { hooks->finished(flow); }
+				} s = { tracer::get().hooks.load(std::memory_order_acquire),
+						flow };
+				s.hooks->started(flow);
+				function();
 			}
+		};
+	} // namespace detail
 
-			for (auto& block : q)
-				block.invoke();
-		}
+	// Trace one block in every so many dispatched by each thread, or none
+	// if every is zero (the default).
+	inline void trace_sampling(unsigned every)
+	{
+		detail::tracer::get().sampling.store(
+			every, std::memory_order_relaxed);
+	}
 
-		// Run blocks as they arrive. Will not return until stop() is called.
-		// When it does return, the queue is guaranteed to be stopped and empty.
-		// This method should typically be called from a background thread.
-		void run_forever()
+	// Replace the hooks called for traced blocks, for example to forward
+	// them to another tracing system. The hooks must stay alive for as long
+	// as blocks might be traced. Pass nullptr to restore the default hooks.
+	inline void set_trace_hooks(const trace_hooks* hooks)
+	{
+		if (!hooks) hooks = detail::default_trace_hooks();
+		detail::tracer::get().hooks.store(hooks, std::memory_order_release);
+	}
+
+	// Name the calling thread in the trace.
+	inline void trace_thread_name(const char* name)
+	{
+		detail::trace_buffer& b = detail::tracer::buffer();
+		std::lock_guard<std::mutex> lock(detail::tracer::get().mutex);
+		b.name = name;
+	}
+
+	// Write the events recorded by the default hooks as Chrome trace JSON.
+	// Each block is a slice on the thread that ran it, with a flow arrow from
+	// the thread that dispatched it. Returns false if writing failed.
+	inline bool write_chrome_trace(FILE* file)
+	{
+		detail::tracer& t = detail::tracer::get();
+		std::vector<detail::trace_buffer*> buffers;
+		std::vector<std::string> names;
 		{
-			while (true) {
-				std::vector<dispatch_block> q;
-				{
-					std::unique_lock<std::mutex> lock(_mutex);
-					while (_queue.empty() && !_done)
-						_cond.wait(lock);
-					std::swap(q, _queue);
-				}
-				if (q.empty()) {
-					assert(_done);
-					_cond.notify_all();
-					return;
+			std::lock_guard<std::mutex> lock(t.mutex);
+			buffers = t.buffers;
+			for (detail::trace_buffer* b : buffers)
+				names.push_back(b->name);
+		}
+
+		const char* separator = "\n";
+		fprintf(file, "{\"traceEvents\":[");
+		for (size_t i = 0; i < buffers.size(); ++i) {
+			detail::trace_buffer& b = *buffers[i];
+			if (!names[i].empty()) {
+				fprintf(
+					file,
+					"%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+					"\"tid\":%u,\"args\":{\"name\":\"",
+					separator, b.tid);
+				for (char c : names[i]) {
+					if (c == '"' || c == '\\') fputc('\\', file);
+					if (uint8_t(c) >= 0x20) fputc(c, file);
 				}
+				fprintf(file, "\"}}");
+				separator = ",\n";
+			}
 
-				for (auto& block : q)
-					block.invoke();
+			size_t size = b.size.load(std::memory_order_acquire);
+			for (size_t j = 0; j < size; ++j) {
+				const detail::trace_event& e = b.events[j];
+				double ts = double(e.time) * 1e-3;
+				unsigned long long flow = e.flow;
+				switch (e.kind) {
+				case detail::trace_kind::dispatched:
+					fprintf(
+						file,
+						"%s{\"name\":\"dispatch\",\"cat\":\"dispatch\","
+						"\"ph\":\"X\",\"dur\":0,\"ts\":%.3f,\"pid\":1,"
+						"\"tid\":%u,\"args\":{\"flow\":%llu}},\n"
+						"{\"name\":\"block\",\"cat\":\"dispatch\","
+						"\"ph\":\"s\",\"id\":%llu,\"ts\":%.3f,\"pid\":1,"
+						"\"tid\":%u}",
+						separator, ts, b.tid, flow, flow, ts, b.tid);
+					break;
+				case detail::trace_kind::started:
+					fprintf(
+						file,
+						"%s{\"name\":\"block\",\"cat\":\"dispatch\","
+						"\"ph\":\"B\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,"
+						"\"args\":{\"flow\":%llu}},\n"
+						"{\"name\":\"block\",\"cat\":\"dispatch\","
+						"\"ph\":\"f\",\"bp\":\"e\",\"id\":%llu,"
+						"\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+						separator, ts, b.tid, flow, flow, ts, b.tid);
+					break;
+				case detail::trace_kind::finished:
+					fprintf(
+						file,
+						"%s{\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+						separator, ts, b.tid);
+					break;
+				}
+				separator = ",\n";
 			}
 		}
+		fprintf(file, "\n]}\n");
+		return !ferror(file);
+	}
+#endif // MORE_DISPATCH_TRACING
 
-		// Destructor. Stops the queue and waits for outstanding blocks to run.
-		~dispatch_queue()
+	namespace detail
+	{
+		// A function stored in a block_arena. The block holds a pointer to it
+		// and to the arena, so moving the block is a memcpy.
+		template <typename F> struct arena_storage
 		{
-			stop();
-			wait_until_done();
-		}
-	};
+			static const size_t size_class = block_arena::size_class(sizeof(F));
 
-	// -------------------------------------------------------------------------
-	// dispatch_thread: runs a dispatch_queue in a single background thread.
-	//
-	// Call dispatch() to execute a block in the background.
-	// Call stop() to stop accepting new blocks.
-	//
-	// The destructor calls stop() then waits for outstanding blocks to finish.
+			struct handle
+			{
+				F* function;
+				block_arena* arena;
+			};
+
+			static handle& get(void* space)
+			{
+				return *static_cast<handle*>(space);
+			}
+
+			template <typename G>
+			static void construct(void* space, G&& f, block_arena& arena)
+			{
+				void* p = arena.allocate(size_class);
+				handle h = { new (p) F(std::forward<G>(f)), &arena };
+				new (space) handle(h);
+			}
+
+			static void invoke(void* space) { (*get(space).function)(); }
+
+			static void invoke_and_destroy(void* space)
+			{
+				invoke(space);
+				destroy(space);
+			}
+
+			static void destroy(void* space)
+			{
+				handle& h = get(space);
+				h.function->~F();
+				h.arena->deallocate(h.function, size_class);
+			}
+
+			static const block_ops ops;
+		};
 
-	class dispatch_thread
+		template <typename F>
+		const block_ops arena_storage<F>::ops = {
+			&arena_storage<F>::invoke,
+			&arena_storage<F>::invoke_and_destroy,
+			nullptr,
+			&arena_storage<F>::destroy,
+		};
+	} // namespace detail
+
+	template <size_t InlineSize, bool HeapFallback = true>
+	class basic_dispatch_block
 	{
-		dispatch_queue _queue;
-		std::thread _thread;
+		static_assert(
+			InlineSize >= sizeof(void*) && InlineSize % sizeof(void*) == 0,
+			"InlineSize must be a non-zero multiple of sizeof(void*)");
+
+		const detail::block_ops* _ops;
+		void* _space[InlineSize / sizeof(void*)];
+
+		static std::atomic<size_t> _heap_count;
 
 	public:
-		dispatch_thread() : _thread(&dispatch_queue::run_forever, &_queue) {}
+		// Space available for a function stored inline.
+		static const size_t capacity = InlineSize;
 
-		// Get this thread's dispatch queue.
-		dispatch_queue& queue() { return _queue; }
+		// Whether a function of type F will be stored inline.
+		template <typename F> struct fits_inline
+		{
+			static const bool value =
+				sizeof(F) <= capacity && alignof(F) <= alignof(void*);
+		};
 
-		// Post a lambda expression for execution on the background thread.
-		// Returns true on success, false if the queue is stopped.
-		template <typename F> bool dispatch(F&& function)
+		// Whether a block holding a function of type F can be moved with a
+		// memcpy. That's true for inline functions that are trivially
+		// copyable (such as lambdas that only capture pointers and numbers)
+		// and for every function that's stored out of line.
+		template <typename F> struct trivially_relocatable
+		{
+			static const bool value = !fits_inline<F>::value
+				|| std::is_trivially_copyable<F>::value;
+		};
+
+		// Make an empty block.
+		basic_dispatch_block() : _ops(nullptr) {}
+
+		basic_dispatch_block(const basic_dispatch_block&) = delete;
+		basic_dispatch_block& operator=(const basic_dispatch_block&) = delete;
+
+		basic_dispatch_block(basic_dispatch_block&& other) : _ops(other._ops)
 		{
-			return _queue.dispatch<F>(std::move(function));
+			_relocate_from(other);
 		}
 
-		// Stop accepting new blocks. dispatch() will now return false.
-		// This method is idempotent; it's safe to call it multiple times.
-		void stop() { _queue.stop(); }
+		basic_dispatch_block& operator=(basic_dispatch_block&& other)
+		{
+			if (this != &other) {
+				_destroy();
+				_ops = other._ops;
+				_relocate_from(other);
+			}
+			return *this;
+		}
 
-		// Destructor. Stops the queue and waits for outstanding blocks to run.
-		~dispatch_thread()
+		// Wrap a lambda expression or functor.
+		template <
+			typename F,
+			typename Fn = typename std::decay<F>::type,
+			typename = typename std::enable_if<
+				!std::is_same<Fn, basic_dispatch_block>::value>::type>
+		basic_dispatch_block(F&& function) : _ops(nullptr)
 		{
-			_queue.stop();
-			_queue.wait_until_done();
-			_thread.join();
+			_construct<Fn>(
+				std::forward<F>(function),
+				std::integral_constant<bool, fits_inline<Fn>::value>());
 		}
-	};
+
+		// Wrap a lambda expression or functor, using the arena if it doesn't
+		// fit inline.
+		template <
+			typename F,
+			typename Fn = typename std::decay<F>::type,
+			typename = typename std::enable_if<
+				!std::is_same<Fn, basic_dispatch_block>::value>::type>
+		basic_dispatch_block(F&& function, block_arena& arena) : _ops(nullptr)
+		{
+#if MORE_DISPATCH_TRACING
+			typedef detail::traced_function<Fn> traced;
+			typedef std::integral_constant<
+				bool, HeapFallback || fits_inline<traced>::value>
+				can_trace;
+			if (_construct_traced<Fn, F>(function, arena, can_trace()))
+				return;
+#endif
+			_construct<Fn>(
+				std::forward<F>(function),
+				arena,
+				std::integral_constant<bool, fits_inline<Fn>::value>());
+		}
+
+		~basic_dispatch_block() { _destroy(); }
+
+		// Whether the block holds a function.
+		explicit operator bool() const { return _ops != nullptr; }
+
+		// Destroy the function, if any, leaving the block empty.
+		void reset() { _destroy(); }
+
+		void invoke()
+		{
+			assert(_ops);
+			_ops->invoke(_space);
+		}
+
+		void operator()() { invoke(); }
+
+		// Call the function and then destroy it, which is cheaper than doing
+		// each separately. Afterwards the block is empty, and can't be
+		// invoked again.
+		void invoke_and_destroy()
+		{
+			assert(_ops);
+			const detail::block_ops* ops = _ops;
+			_ops = nullptr;
+			ops->invoke_and_destroy(_space);
+		}
+
+		// The number of blocks of this type that have been too large to
+		// store inline, and have fallen back to the heap or an arena.
+		static size_t heap_allocations()
+		{
+			return _heap_count.load(std::memory_order_relaxed);
+		}
+
+	private:
+		// Take over the function from another block, whose _ops we've
+		// already copied.
+		void _relocate_from(basic_dispatch_block& other)
+		{
+			if (!_ops) return;
+			if (_ops->relocate) _ops->relocate(_space, other._space);
+			else std::memcpy(_space, other._space, sizeof(_space));
+			other._ops = nullptr;
+		}
+
+		void _destroy()
+		{
+			if (_ops && _ops->destroy) _ops->destroy(_space);
+			_ops = nullptr;
+		}
+
+		template <typename Fn> void _check_heap_fallback()
+		{
+			static_assert(
+				HeapFallback && sizeof(Fn) > 0,
+				"function is too large to fit inline in a dispatch_block");
+			_heap_count.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		template <typename Fn, typename F>
+		void _construct(F&& function, std::true_type)
+		{
+			detail::inline_storage<Fn>::construct(
+				_space, std::forward<F>(function));
+			_ops = &detail::inline_storage<Fn>::ops;
+		}
+
+		template <typename Fn, typename F>
+		void _construct(F&& function, std::false_type)
+		{
+			_check_heap_fallback<Fn>();
+			detail::boxed_storage<Fn>::construct(
+				_space, std::forward<F>(function));
+			_ops = &detail::boxed_storage<Fn>::ops;
+		}
+
+		template <typename Fn, typename F>
+		void _construct(F&& function, block_arena&, std::true_type)
+		{
+			_construct<Fn>(std::forward<F>(function), std::true_type());
+		}
+
+		template <typename Fn, typename F>
+		void _construct(F&& function, block_arena& arena, std::false_type)
+		{
+			typedef std::integral_constant<
+				bool,
+				block_arena::fits<Fn>::value
+					&& sizeof(typename detail::arena_storage<Fn>::handle)
+						<= capacity>
+				use_arena;
+			_construct_in<Fn>(arena, std::forward<F>(function), use_arena());
+		}
+
+		template <typename Fn, typename F>
+		void _construct_in(block_arena& arena, F&& function, std::true_type)
+		{
+			_check_heap_fallback<Fn>();
+			detail::arena_storage<Fn>::construct(
+				_space, std::forward<F>(function), arena);
+			_ops = &detail::arena_storage<Fn>::ops;
+		}
+
+		template <typename Fn, typename F>
+		void _construct_in(block_arena&, F&& function, std::false_type)
+		{
+			_construct<Fn>(std::forward<F>(function), std::false_type());
+		}
+
+#if MORE_DISPATCH_TRACING
+		// If this block is sampled, wrap the function so that it's traced,
+		// and return true. F is the constructor's forwarding type, so the
+		// function is moved from an rvalue but copied from an lvalue.
+		template <typename Fn, typename F>
+		bool _construct_traced(F& function, block_arena& arena, std::true_type)
+		{
+			uint64_t flow = detail::trace_dispatch();
+			if (!flow) return false;
+			typedef detail::traced_function<Fn> traced;
+			_construct<traced>(
+				traced(std::forward<F>(function), flow),
+				arena,
+				std::integral_constant<bool, fits_inline<traced>::value>());
+			return true;
+		}
+
+		template <typename Fn, typename F>
+		bool _construct_traced(F&, block_arena&, std::false_type)
+		{
+			return false;
+		}
+#endif
+	};
+
+	template <size_t InlineSize, bool HeapFallback>
+	std::atomic<size_t>
+		basic_dispatch_block<InlineSize, HeapFallback>::_heap_count(0);
+
+#ifndef MORE_DISPATCH_INLINE_SIZE
+#define MORE_DISPATCH_INLINE_SIZE (4 * sizeof(void*))
+#endif
+
+#ifndef MORE_DISPATCH_HEAP_FALLBACK
+#define MORE_DISPATCH_HEAP_FALLBACK 1
+#endif
+
+	typedef basic_dispatch_block<
+		MORE_DISPATCH_INLINE_SIZE,
+		MORE_DISPATCH_HEAP_FALLBACK != 0>
+		dispatch_block;
+
+	// -------------------------------------------------------------------------
+	// idle_policy: what a queue's consumer does when it runs out of blocks.
+	//
+	// By default the consumer goes straight to sleep, so the next block to
+	// arrive pays the full cost of waking a thread (often tens of
+	// microseconds). An idle_policy makes it spin for a while first, then
+	// yield its time slice for a while, and only then sleep. That trades CPU
+	// time for much lower dispatch-to-run latency with bursty traffic.
+
+	struct idle_policy
+	{
+		size_t spins; // Number of times to spin, checking for work.
+		size_t yields; // Then, number of times to yield, checking for work.
+
+		idle_policy(size_t spins = 0, size_t yields = 0)
+			: spins(spins)
+			, yields(yields)
+		{
+		}
+
+		// Go straight to sleep. This is the default.
+		static idle_policy sleep() { return idle_policy(); }
+
+		// Spin and yield for roughly tens of microseconds before sleeping.
+		static idle_policy low_latency() { return idle_policy(10000, 100); }
+
+		// Spin, then yield, until ready() returns true or the budget runs
+		// out. Returns the last result of ready().
+		template <typename Ready> bool poll(Ready ready) const
+		{
+			for (size_t i = 0; i < spins; ++i) {
+				if (ready()) return true;
+				pause();
+			}
+			for (size_t i = 0; i < yields; ++i) {
+				if (ready()) return true;
+				std::this_thread::yield();
+			}
+			return ready();
+		}
+
+		// Tell the CPU we're in a spin loop.
+		static void pause()
+		{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+			_mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+			__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+			__asm__ __volatile__("yield");
+#endif
+		}
+	};
+
+	// -------------------------------------------------------------------------
+	// dispatch_batch: collects blocks, to be sent to a queue all at once.
+	//
+	// Sending a batch with dispatch_bulk() takes the queue's lock (or wakes
+	// its consumer) once for the whole batch, rather than once per block.
+	// A batch can be reused after it's sent; it keeps its capacity.
+
+	class dispatch_batch
+	{
+		friend class dispatch_queue;
+		friend class ring_dispatch_queue;
+
+		std::vector<dispatch_block> _blocks;
+
+	public:
+		dispatch_batch() = default;
+		dispatch_batch(dispatch_batch&&) = default;
+		dispatch_batch& operator=(dispatch_batch&&) = default;
+
+		// Add a lambda expression or functor to the batch.
+		template <typename F> void dispatch(F&& lambda)
+		{
+			_blocks.emplace_back(std::forward<F>(lambda));
+		}
+
+		void reserve(size_t blocks) { _blocks.reserve(blocks); }
+		size_t size() const { return _blocks.size(); }
+		bool empty() const { return _blocks.empty(); }
+		void clear() { _blocks.clear(); }
+	};
+
+	// -------------------------------------------------------------------------
+	// qos: quality-of-service classes, from highest priority to lowest.
+
+	enum class qos
+	{
+		interactive, // Latency-critical work, like UI or control messages.
+		normal, // The default.
+		background, // Bulk work that can wait.
+	};
+
+	static const size_t qos_count = 3;
+
+	// -------------------------------------------------------------------------
+	// overflow_policy: what a bounded dispatch_queue does when it's full.
+
+	enum class overflow_policy
+	{
+		block, // dispatch() waits for room; try_dispatch() fails.
+		drop_oldest, // Throw away the oldest waiting block to make room.
+	};
+
+	namespace detail
+	{
+		// What the queues' schedule() methods return: an awaitable that
+		// resumes a coroutine on the queue. It's defined in
+		// more_dispatch/coroutine.h, which needs C++20.
+		template <typename Queue> struct schedule_awaitable;
+
+		// A lock-free pool of fixed-size objects, carved out of slabs that
+		// are never freed. Each thread keeps a private free list, and refills
+		// it by taking the whole shared free list in one go, so allocating is
+		// usually just a pointer pop. Freed objects go onto the shared list.
+		template <size_t Size, size_t Align> class slab_pool
+		{
+			union node
+			{
+				node* next;
+				typename std::aligned_storage<Size, Align>::type storage;
+			};
+
+			static const size_t slab_size = 64;
+
+			std::atomic<node*> _free;
+			std::mutex _mutex;
+			std::vector<std::unique_ptr<node[]>> _slabs;
+
+			struct local
+			{
+				node* head = nullptr;
+
+				~local()
+				{
+					while (head) {
+						node* n = head;
+						head = n->next;
+						instance().deallocate(n);
+					}
+				}
+			};
+
+			static local& cache()
+			{
+				static thread_local local l;
+				return l;
+			}
+
+			node* _new_slab()
+			{
+				std::unique_ptr<node[]> slab(new node[slab_size]);
+				for (size_t i = 0; i + 1 < slab_size; ++i)
+					slab[i].next = &slab[i + 1];
+				slab[slab_size - 1].next = nullptr;
+
+				std::lock_guard<std::mutex> lock(_mutex);
+				_slabs.push_back(std::move(slab));
+				return &_slabs.back()[0];
+			}
+
+			slab_pool() : _free(nullptr) {}
+
+		public:
+			// There's one pool for each size and alignment. It's never
+			// destroyed, so objects can safely be freed during shutdown.
+			static slab_pool& instance()
+			{
+				static slab_pool* pool = new slab_pool;
+				return *pool;
+			}
+
+			void* allocate()
+			{
+				local& l = cache();
+				if (!l.head) l.head = _free.exchange(nullptr);
+				if (!l.head) l.head = _new_slab();
+				node* n = l.head;
+				l.head = n->next;
+				return n;
+			}
+
+			void deallocate(void* p)
+			{
+				node* n = static_cast<node*>(p);
+				n->next = _free.load(std::memory_order_relaxed);
+				while (!_free.compare_exchange_weak(n->next, n))
+					;
+			}
+		};
+
+		// Base class for objects that are allocated from a slab_pool.
+		template <typename T> struct pooled
+		{
+			static void* operator new(size_t size)
+			{
+				assert(size == sizeof(T));
+				(void)size;
+				return slab_pool<sizeof(T), alignof(T)>::instance().allocate();
+			}
+
+			static void operator delete(void* p)
+			{
+				slab_pool<sizeof(T), alignof(T)>::instance().deallocate(p);
+			}
+		};
+	} // namespace detail
+
+	namespace detail
+	{
+		// Index of the lowest set bit. bits must be non-zero.
+		inline unsigned lowest_bit(uint64_t bits)
+		{
+			assert(bits != 0);
+#if defined(__GNUC__) || defined(__clang__)
+			return unsigned(__builtin_ctzll(bits));
+#elif defined(_MSC_VER) && defined(_M_X64)
+			unsigned long i;
+			_BitScanForward64(&i, bits);
+			return unsigned(i);
+#else
+			unsigned i = 0;
+			while (!(bits & 1)) {
+				bits >>= 1;
+				++i;
+			}
+			return i;
+#endif
+		}
+
+		// Index of the highest set bit. bits must be non-zero.
+		inline unsigned highest_bit(uint64_t bits)
+		{
+			assert(bits != 0);
+#if defined(__GNUC__) || defined(__clang__)
+			return 63 - unsigned(__builtin_clzll(bits));
+#elif defined(_MSC_VER) && defined(_M_X64)
+			unsigned long i;
+			_BitScanReverse64(&i, bits);
+			return unsigned(i);
+#else
+			unsigned i = 0;
+			while (bits >>= 1)
+				++i;
+			return i;
+#endif
+		}
+
+		// A timer scheduled with dispatch_after() or dispatch_every(). It's
+		// shared by the queue, while it's pending, and its dispatch_timer
+		// handle, and is freed when both have let go.
+		struct timer_node : pooled<timer_node>
+		{
+			enum : int { armed, fired, cancelled };
+
+			timer_node* next = nullptr;
+			uint64_t expiry; // In timer_wheel ticks.
+			uint64_t period; // Zero for a one-shot timer.
+			std::atomic<int> state;
+			std::atomic<unsigned> refs;
+			dispatch_block block;
+
+			template <typename F>
+			timer_node(F&& lambda, uint64_t expiry, uint64_t period)
+				: expiry(expiry)
+				, period(period)
+				, state(armed)
+				, refs(2)
+				, block(std::forward<F>(lambda))
+			{
+			}
+
+			bool is_cancelled() const
+			{
+				return state.load(std::memory_order_acquire) == cancelled;
+			}
+
+			// Run the block, unless the timer has been cancelled. Returns
+			// true if it's a repeating timer that should be rescheduled.
+			bool fire()
+			{
+				if (period == 0) {
+					int s = armed;
+					if (state.compare_exchange_strong(s, fired))
+						block.invoke_and_destroy();
+					return false;
+				}
+				if (is_cancelled()) return false;
+				block.invoke();
+				return !is_cancelled();
+			}
+
+			bool cancel()
+			{
+				int s = armed;
+				return state.compare_exchange_strong(s, cancelled);
+			}
+
+			void release()
+			{
+				if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+					delete this;
+			}
+		};
+
+		// A hierarchical timing wheel, after Varghese and Lauck.
+		//
+		// Time is counted in ticks of one millisecond. Level 0 has a slot for
+		// each of the next 64 ticks; each level above has slots 64 times as
+		// wide, so six levels cover a couple of years. A timer goes into the
+		// lowest level whose range reaches its expiry, and as time passes,
+		// each slot's timers are moved down ("cascaded") a level at a time,
+		// until they land in level 0 and expire. Inserting is O(1), and
+		// cancelling just marks the timer, so it's O(1) too; cancelled
+		// timers are thrown away when their slot comes round.
+		//
+		// A bitmap of non-empty slots for each level means we can jump
+		// straight to the next tick with anything to do, rather than visiting
+		// every tick in turn.
+		//
+		// This class isn't thread-safe; dispatch_queue guards it with its lock.
+		class timer_wheel
+		{
+		public:
+			typedef std::chrono::steady_clock clock;
+			typedef std::chrono::milliseconds tick;
+
+			static const unsigned slot_bits = 6;
+			static const unsigned slots = 1u << slot_bits;
+			static const unsigned levels = 6;
+			static const uint64_t never = ~uint64_t(0);
+
+		private:
+			struct slot
+			{
+				timer_node* head = nullptr;
+				timer_node* tail = nullptr;
+
+				bool empty() const { return head == nullptr; }
+
+				void push_back(timer_node* n)
+				{
+					n->next = nullptr;
+					if (tail) tail->next = n;
+					else head = n;
+					tail = n;
+				}
+
+				timer_node* take()
+				{
+					timer_node* n = head;
+					head = tail = nullptr;
+					return n;
+				}
+			};
+
+			clock::time_point _start;
+			uint64_t _now = 0; // Every timer up to this tick has expired.
+			size_t _size = 0;
+			slot _due; // Timers inserted already expired.
+			slot _slots[levels][slots];
+			uint64_t _occupied[levels] = {}; // Bitmaps of non-empty slots.
+
+			static uint64_t rotate_right(uint64_t bits, unsigned n)
+			{
+				n &= 63;
+				return n ? (bits >> n) | (bits << (64 - n)) : bits;
+			}
+
+			void _insert(timer_node* n)
+			{
+				uint64_t delta = n->expiry > _now ? n->expiry - _now : 0;
+				if (delta == 0) {
+					_due.push_back(n);
+					return;
+				}
+
+				unsigned level = highest_bit(delta) / slot_bits;
+				uint64_t index;
+				if (level < levels) {
+					index = n->expiry >> (level * slot_bits);
+				} else {
+					// Too far away. Park it in the top level's last slot, and
+					// it will be put back when that comes round.
+					level = levels - 1;
+					index = (_now >> (level * slot_bits)) + slots - 1;
+				}
+				index &= slots - 1;
+				_slots[level][index].push_back(n);
+				_occupied[level] |= uint64_t(1) << index;
+			}
+
+			// Empty out a slot, putting its timers into the output list.
+			template <typename Out> void _expire(slot& s, Out& fired)
+			{
+				for (timer_node* n = s.take(); n;) {
+					timer_node* next = n->next;
+					fired.push_back(n);
+					--_size;
+					n = next;
+				}
+			}
+
+			// Move a slot's timers down to where they belong now. Cancelled
+			// ones go to the output list, to be freed.
+			template <typename Out>
+			void _cascade(unsigned level, unsigned index, Out& fired)
+			{
+				_occupied[level] &= ~(uint64_t(1) << index);
+				for (timer_node* n = _slots[level][index].take(); n;) {
+					timer_node* next = n->next;
+					if (n->is_cancelled()) {
+						fired.push_back(n);
+						--_size;
+					} else {
+						_insert(n);
+					}
+					n = next;
+				}
+			}
+
+			// The next tick after _now when a slot needs attention, or never.
+			uint64_t _next_event() const
+			{
+				uint64_t next = never;
+				for (unsigned level = 0; level < levels; ++level) {
+					uint64_t occupied = _occupied[level];
+					if (!occupied) continue;
+					unsigned shift = level * slot_bits;
+					uint64_t now = _now >> shift;
+					unsigned from = unsigned(now + 1) & (slots - 1);
+					uint64_t ahead = rotate_right(occupied, from);
+					uint64_t distance = lowest_bit(ahead) + 1;
+					next = std::min(next, (now + distance) << shift);
+				}
+				return next;
+			}
+
+		public:
+			timer_wheel() : _start(clock::now()) {}
+
+			timer_wheel(const timer_wheel&) = delete;
+			timer_wheel& operator=(const timer_wheel&) = delete;
+
+			bool empty() const { return _size == 0; }
+
+			// The first tick at or after a point in time, so that timers
+			// never fire early.
+			uint64_t ticks(clock::time_point t) const
+			{
+				if (t <= _start) return 0;
+				auto d = std::chrono::duration_cast<tick>(t - _start);
+				if (_start + d < t) d += tick(1);
+				return uint64_t(d.count());
+			}
+
+			template <typename Rep, typename Period>
+			static uint64_t ticks(std::chrono::duration<Rep, Period> d)
+			{
+				auto t = std::chrono::duration_cast<tick>(d);
+				if (t < d) t += tick(1);
+				return t.count() > 0 ? uint64_t(t.count()) : 0;
+			}
+
+			// The current tick, rounded down.
+			uint64_t now() const
+			{
+				auto d =
+					std::chrono::duration_cast<tick>(clock::now() - _start);
+				return uint64_t(d.count());
+			}
+
+			clock::time_point time(uint64_t t) const
+			{
+				return _start + tick(t);
+			}
+
+			// The tick of the next expiry, or possibly a little earlier.
+			uint64_t next_expiry() const
+			{
+				return _due.empty() ? _next_event() : _now;
+			}
+
+			void insert(timer_node* n)
+			{
+				++_size;
+				_insert(n);
+			}
+
+			// Schedule a repeating timer that has just fired. Any ticks it
+			// missed, because the consumer was busy, are skipped.
+			void reschedule(timer_node* n)
+			{
+				uint64_t period = n->period;
+				n->expiry += period;
+				if (n->expiry <= _now)
+					n->expiry += ((_now - n->expiry) / period + 1) * period;
+				insert(n);
+			}
+
+			// Move time forward to the given tick, putting every timer that
+			// expires on the way into the output list.
+			template <typename Out> void advance(uint64_t to, Out& fired)
+			{
+				_expire(_due, fired);
+				while (true) {
+					uint64_t t = _next_event();
+					if (t > to) break;
+					_now = t;
+					for (unsigned level = levels - 1; level > 0; --level) {
+						unsigned shift = level * slot_bits;
+						if (t & ((uint64_t(1) << shift) - 1)) continue;
+						unsigned index = unsigned(t >> shift) & (slots - 1);
+						_cascade(level, index, fired);
+					}
+					unsigned index = unsigned(t) & (slots - 1);
+					_occupied[0] &= ~(uint64_t(1) << index);
+					_expire(_slots[0][index], fired);
+					_expire(_due, fired);
+				}
+				if (to > _now) _now = to;
+			}
+
+			// Free every pending timer.
+			~timer_wheel()
+			{
+				std::vector<timer_node*> all;
+				_expire(_due, all);
+				for (auto& level : _slots)
+					for (auto& s : level)
+						_expire(s, all);
+				for (timer_node* n : all)
+					n->release();
+			}
+		};
+	} // namespace detail
+
+	// -------------------------------------------------------------------------
+	// dispatch_timer: a handle to a block scheduled with dispatch_after() or
+	// dispatch_every(). It can be used to cancel the timer.
+	//
+	// Destroying the handle doesn't cancel the timer, and the handle can
+	// safely outlive its queue.
+
+	class dispatch_timer
+	{
+		friend class dispatch_queue;
+
+		detail::timer_node* _node;
+
+		explicit dispatch_timer(detail::timer_node* node) : _node(node) {}
+
+	public:
+		dispatch_timer() : _node(nullptr) {}
+
+		dispatch_timer(dispatch_timer&& other) : _node(other._node)
+		{
+			other._node = nullptr;
+		}
+
+		dispatch_timer& operator=(dispatch_timer&& other)
+		{
+			std::swap(_node, other._node);
+			return *this;
+		}
+
+		dispatch_timer(const dispatch_timer&) = delete;
+		dispatch_timer& operator=(const dispatch_timer&) = delete;
+
+		// False if the timer couldn't be scheduled, because the queue was
+		// stopped.
+		bool valid() const { return _node != nullptr; }
+
+		// Stop the timer from firing again. Returns true on success, false if
+		// it's a one-shot timer that has already fired, or it was already
+		// cancelled. The block itself is freed later, on the queue's thread.
+		bool cancel() { return _node && _node->cancel(); }
+
+		~dispatch_timer()
+		{
+			if (_node) _node->release();
+		}
+	};
+
+	// -------------------------------------------------------------------------
+	// cancellation_token: a shared flag for revoking blocks that haven't
+	// started yet.
+	//
+	// Call dispatch(queue, token, block) to dispatch a block that is skipped
+	// if the token is cancelled before it starts. (A block that has started
+	// runs to completion; it can check cancelled() itself.) Copies of a token
+	// share one flag, and a token made by child() is cancelled along with
+	// its parent, so cancelling one token can revoke a whole tree of work.
+	//
+	// Cancelled blocks stay in their queue until the consumer reaches them,
+	// but are then destroyed without being run. The check is a few atomic
+	// loads in the block itself, so the consumer never takes a lock for it.
+	// Making a token takes one allocation from a slab pool, and copying one
+	// bumps a reference count.
+
+	namespace detail
+	{
+		struct cancel_state : pooled<cancel_state>
+		{
+			std::atomic<bool> flag;
+			std::atomic<unsigned> refs;
+			cancel_state* parent; // Holds a reference.
+
+			explicit cancel_state(cancel_state* parent)
+				: flag(false)
+				, refs(1)
+				, parent(parent)
+			{
+				if (parent) parent->retain();
+			}
+
+			bool cancelled() const
+			{
+				for (const cancel_state* s = this; s; s = s->parent)
+					if (s->flag.load(std::memory_order_acquire)) return true;
+				return false;
+			}
+
+			void retain() { refs.fetch_add(1, std::memory_order_relaxed); }
+
+			void release()
+			{
+				cancel_state* s = this;
+				while (s
+					   && s->refs.fetch_sub(1, std::memory_order_acq_rel)
+						   == 1) {
+					cancel_state* parent = s->parent;
+					delete s;
+					s = parent;
+				}
+			}
+		};
+	} // namespace detail
+
+	class cancellation_token
+	{
+		detail::cancel_state* _state;
+
+		explicit cancellation_token(detail::cancel_state* state)
+			: _state(state)
+		{
+		}
+
+	public:
+		// Make a new token, which isn't cancelled.
+		cancellation_token() : _state(new detail::cancel_state(nullptr)) {}
+
+		cancellation_token(const cancellation_token& other)
+			: _state(other._state)
+		{
+			_state->retain();
+		}
+
+		// A moved-from token can only be assigned to or destroyed.
+		cancellation_token(cancellation_token&& other) : _state(other._state)
+		{
+			other._state = nullptr;
+		}
+
+		cancellation_token& operator=(cancellation_token other)
+		{
+			std::swap(_state, other._state);
+			return *this;
+		}
+
+		~cancellation_token()
+		{
+			if (_state) _state->release();
+		}
+
+		// Make a token that is cancelled when this one is, or on its own.
+		cancellation_token child() const
+		{
+			return cancellation_token(new detail::cancel_state(_state));
+		}
+
+		// Cancel every block dispatched with this token (or its children)
+		// that hasn't started yet, and any dispatched with it later.
+		// Returns true if it wasn't already cancelled.
+		bool cancel()
+		{
+			return !_state->flag.exchange(true, std::memory_order_acq_rel);
+		}
+
+		// Whether this token, or any of its parents, has been cancelled.
+		bool cancelled() const { return _state->cancelled(); }
+
+		// Whether two tokens share a flag.
+		bool operator==(const cancellation_token& other) const
+		{
+			return _state == other._state;
+		}
+
+		bool operator!=(const cancellation_token& other) const
+		{
+			return _state != other._state;
+		}
+	};
+
+	namespace detail
+	{
+		// The function in a block dispatched with a cancellation_token.
+		template <typename F> struct cancellable_function
+		{
+			cancellation_token token;
+			F function;
+
+			void operator()()
+			{
+				if (!token.cancelled()) function();
+			}
+		};
+	} // namespace detail
+
+	// Dispatch a block to any queue, thread or pool, unless the token is
+	// cancelled before it starts. Returns true on success, false if the
+	// queue is stopped.
+	template <typename Queue, typename F>
+	bool dispatch(Queue& queue, const cancellation_token& token, F&& f)
+	{
+		typedef typename std::decay<F>::type function_type;
+		return queue.dispatch(detail::cancellable_function<function_type> {
+			token, std::forward<F>(f) });
+	}
+
+#if MORE_DISPATCH_METRICS
+	// -------------------------------------------------------------------------
+	// Metrics: counters, depth and latency histograms for dispatch_queue.
+	//
+	// These only exist if MORE_DISPATCH_METRICS is defined to 1, and
+	// otherwise cost nothing. When they're on, dispatch_queue::metrics()
+	// returns a snapshot, and to_prometheus() formats one in the Prometheus
+	// text exposition format.
+
+	namespace detail
+	{
+		inline uint64_t now_ns()
+		{
+			auto t = std::chrono::steady_clock::now().time_since_epoch();
+			return uint64_t(
+				std::chrono::duration_cast<std::chrono::nanoseconds>(t)
+					.count());
+		}
+	} // namespace detail
+
+	// A snapshot of a latency_histogram.
+	struct histogram_snapshot
+	{
+		static const unsigned sub_bits = 3;
+		static const unsigned sub_buckets = 1u << sub_bits;
+		static const size_t bucket_count = (64 - sub_bits + 1) * sub_buckets;
+
+		uint64_t buckets[bucket_count];
+		uint64_t count;
+		uint64_t sum; // In nanoseconds, like all values.
+		uint64_t max;
+
+		// The bucket that holds a value.
+		static size_t bucket(uint64_t value)
+		{
+			if (value < sub_buckets) return size_t(value);
+			unsigned high = detail::highest_bit(value);
+			unsigned shift = high - sub_bits;
+			size_t sub = size_t(value >> shift) & (sub_buckets - 1);
+			return (shift + 1) * sub_buckets + sub;
+		}
+
+		// The smallest and largest values that go in a bucket.
+		static uint64_t lower_bound(size_t i)
+		{
+			if (i < sub_buckets) return i;
+			unsigned shift = unsigned(i / sub_buckets) - 1;
+			return uint64_t(sub_buckets + i % sub_buckets) << shift;
+		}
+
+		static uint64_t upper_bound(size_t i)
+		{
+			return i + 1 < bucket_count ? lower_bound(i + 1) - 1 : ~uint64_t(0);
+		}
+
+		// The value below which the given fraction of recorded values fall,
+		// to within a bucket. For example, percentile(0.99) is the p99.
+		uint64_t percentile(double fraction) const
+		{
+			if (count == 0) return 0;
+			uint64_t rank = uint64_t(fraction * double(count - 1)) + 1;
+			uint64_t seen = 0;
+			for (size_t i = 0; i < bucket_count; ++i) {
+				seen += buckets[i];
+				if (seen >= rank) return std::min(upper_bound(i), max);
+			}
+			return max;
+		}
+	};
+
+	// A log-linear histogram of durations in nanoseconds, in the style of
+	// HdrHistogram. Each power of two is split into eight buckets, so values
+	// are recorded to within 12.5%. Recording is a few shifts and a relaxed
+	// atomic increment, and is safe from any thread.
+	class latency_histogram
+	{
+		std::atomic<uint64_t> _buckets[histogram_snapshot::bucket_count];
+		std::atomic<uint64_t> _count;
+		std::atomic<uint64_t> _sum;
+		std::atomic<uint64_t> _max;
+
+	public:
+		latency_histogram()
+			: _count(0)
+			, _sum(0)
+			, _max(0)
+		{
+			for (auto& b : _buckets)
+				b.store(0, std::memory_order_relaxed);
+		}
+
+		void record(uint64_t ns)
+		{
+			size_t i = histogram_snapshot::bucket(ns);
+			_buckets[i].fetch_add(1, std::memory_order_relaxed);
+			_count.fetch_add(1, std::memory_order_relaxed);
+			_sum.fetch_add(ns, std::memory_order_relaxed);
+			uint64_t max = _max.load(std::memory_order_relaxed);
+			while (ns > max
+				   && !_max.compare_exchange_weak(
+					   max, ns, std::memory_order_relaxed))
+				;
+		}
+
+		// The snapshot isn't atomic as a whole, but each field is.
+		histogram_snapshot snapshot() const
+		{
+			histogram_snapshot s;
+			for (size_t i = 0; i < histogram_snapshot::bucket_count; ++i)
+				s.buckets[i] = _buckets[i].load(std::memory_order_relaxed);
+			s.count = _count.load(std::memory_order_relaxed);
+			s.sum = _sum.load(std::memory_order_relaxed);
+			s.max = _max.load(std::memory_order_relaxed);
+			return s;
+		}
+	};
+
+	// A snapshot of a dispatch_queue's metrics.
+	struct queue_metrics
+	{
+		uint64_t enqueued; // Blocks accepted by dispatch().
+		uint64_t executed; // Blocks that have finished running.
+		uint64_t dropped; // Blocks thrown away by drop_oldest.
+		uint64_t depth; // Blocks waiting or running right now.
+		uint64_t max_depth; // The highest depth so far.
+		histogram_snapshot wait; // From dispatch() to starting to run.
+		histogram_snapshot run; // Time spent running.
+
+		// The queue's lock, as dispatch() sees it: how long it waited to
+		// take it (zero if it was free), and how long it held it. With a
+		// bounded queue, holding includes waiting for room.
+		histogram_snapshot lock_wait;
+		histogram_snapshot lock_hold;
+	};
+
+	namespace detail
+	{
+		// The live counters behind queue_metrics.
+		struct queue_counters
+		{
+			std::atomic<uint64_t> enqueued;
+			std::atomic<uint64_t> executed;
+			std::atomic<uint64_t> dropped;
+			std::atomic<uint64_t> max_depth;
+			latency_histogram wait;
+			latency_histogram run;
+			latency_histogram lock_wait;
+			latency_histogram lock_hold;
+
+			queue_counters()
+				: enqueued(0)
+				, executed(0)
+				, dropped(0)
+				, max_depth(0)
+			{
+			}
+
+			// Called by producers, with the queue's lock held.
+			void did_enqueue(size_t count)
+			{
+				uint64_t total =
+					enqueued.fetch_add(count, std::memory_order_relaxed)
+					+ count;
+				uint64_t done = executed.load(std::memory_order_relaxed)
+					+ dropped.load(std::memory_order_relaxed);
+				uint64_t depth = total - std::min(total, done);
+				if (depth > max_depth.load(std::memory_order_relaxed))
+					max_depth.store(depth, std::memory_order_relaxed);
+			}
+
+			queue_metrics snapshot() const
+			{
+				queue_metrics m;
+				m.executed = executed.load(std::memory_order_relaxed);
+				m.dropped = dropped.load(std::memory_order_relaxed);
+				m.enqueued = enqueued.load(std::memory_order_relaxed);
+				uint64_t done = m.executed + m.dropped;
+				m.depth = m.enqueued - std::min(m.enqueued, done);
+				m.max_depth = max_depth.load(std::memory_order_relaxed);
+				m.wait = wait.snapshot();
+				m.run = run.snapshot();
+				m.lock_wait = lock_wait.snapshot();
+				m.lock_hold = lock_hold.snapshot();
+				return m;
+			}
+		};
+
+		// A unique_lock that records how long it took to take the lock,
+		// and how long it was held, in a queue's counters. It only looks at
+		// the clock to time the wait if the lock is contended.
+		class metered_lock : public std::unique_lock<std::mutex>
+		{
+			queue_counters& _counters;
+			uint64_t _acquired;
+
+		public:
+			metered_lock(std::mutex& mutex, queue_counters& counters)
+				: std::unique_lock<std::mutex>(mutex, std::try_to_lock)
+				, _counters(counters)
+			{
+				if (owns_lock()) {
+					_acquired = now_ns();
+					_counters.lock_wait.record(0);
+					return;
+				}
+				uint64_t start = now_ns();
+				lock();
+				_acquired = now_ns();
+				_counters.lock_wait.record(_acquired - start);
+			}
+
+			~metered_lock()
+			{
+				if (!owns_lock()) return;
+				_counters.lock_hold.record(now_ns() - _acquired);
+			}
+		};
+
+		inline void append_prometheus_histogram(
+			std::string& out, const std::string& name,
+			const histogram_snapshot& h)
+		{
+			// One bucket for each power of two from 1us to about 1 minute.
+			char line[256];
+			out += "# TYPE " + name + " histogram\n";
+			uint64_t cumulative = 0;
+			size_t i = 0;
+			for (unsigned power = 10; power <= 36; ++power) {
+				uint64_t le = uint64_t(1) << power;
+				while (i < histogram_snapshot::bucket_count
+					   && histogram_snapshot::upper_bound(i) < le)
+					cumulative += h.buckets[i++];
+				snprintf(
+					line, sizeof(line), "%s_bucket{le=\"%.9g\"} %llu\n",
+					name.c_str(), double(le) * 1e-9,
+					(unsigned long long)cumulative);
+				out += line;
+			}
+			snprintf(
+				line, sizeof(line),
+				"%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9g\n%s_count %llu\n",
+				name.c_str(), (unsigned long long)h.count, name.c_str(),
+				double(h.sum) * 1e-9, name.c_str(),
+				(unsigned long long)h.count);
+			out += line;
+		}
+	} // namespace detail
+
+	// Format a queue's metrics in the Prometheus text format, with each
+	// metric name starting with the given prefix. Times are in seconds.
+	inline std::string
+	to_prometheus(const queue_metrics& m, const std::string& prefix)
+	{
+		std::string out;
+		char line[256];
+		const struct
+		{
+			const char* name;
+			const char* type;
+			uint64_t value;
+		} scalars[] = {
+			{ "_enqueued_total", "counter", m.enqueued },
+			{ "_executed_total", "counter", m.executed },
+			{ "_dropped_total", "counter", m.dropped },
+			{ "_depth", "gauge", m.depth },
+			{ "_max_depth", "gauge", m.max_depth },
+		};
+		for (auto& s : scalars) {
+			snprintf(
+				line, sizeof(line), "# TYPE %s%s %s\n%s%s %llu\n",
+				prefix.c_str(), s.name, s.type, prefix.c_str(), s.name,
+				(unsigned long long)s.value);
+			out += line;
+		}
+		detail::append_prometheus_histogram(
+			out, prefix + "_wait_seconds", m.wait);
+		detail::append_prometheus_histogram(
+			out, prefix + "_run_seconds", m.run);
+		detail::append_prometheus_histogram(
+			out, prefix + "_lock_wait_seconds", m.lock_wait);
+		detail::append_prometheus_histogram(
+			out, prefix + "_lock_hold_seconds", m.lock_hold);
+		return out;
+	}
+#endif // MORE_DISPATCH_METRICS
+
+	class dispatch_queue;
+
+#ifndef MORE_DISPATCH_CACHE_LINE
+#if defined(__APPLE__) && defined(__aarch64__)
+#define MORE_DISPATCH_CACHE_LINE 128
+#else
+#define MORE_DISPATCH_CACHE_LINE 64
+#endif
+#endif
+
+	namespace detail
+	{
+		// Padding that keeps the members either side of it off each other's
+		// cache lines. This is used instead of alignas, because allocating
+		// an over-aligned type with new needs C++17.
+		struct cache_pad
+		{
+			char bytes[MORE_DISPATCH_CACHE_LINE];
+		};
+
+		// The number of producers still destroying blocks that a queue (or
+		// pool) refused, because it was stopped, or dropped to make room for
+		// theirs. They do that after releasing
+		// the lock, since a block's captures might dispatch to the same queue
+		// as they're destroyed. But the block might be using the queue's
+		// arena, so the queue's destructor calls wait() before freeing it.
+		// enter() must be called with the queue's lock held, and wait()
+		// after the destructor has taken the lock for the last time.
+		class discard_count
+		{
+			std::atomic<size_t> _count;
+
+		public:
+			discard_count() : _count(0) {}
+
+			void enter() { _count.fetch_add(1, std::memory_order_relaxed); }
+			void leave() { _count.fetch_sub(1, std::memory_order_release); }
+
+			void wait() const
+			{
+				while (_count.load(std::memory_order_acquire) > 0)
+					std::this_thread::yield();
+			}
+		};
+
+		// Blocks a producer is to destroy once it has released the queue's
+		// lock. See discard_count. Declare it before taking the lock, so that
+		// it's destroyed after the lock is released.
+		class discard_list
+		{
+			discard_count* _count;
+			dispatch_block _block; // There's usually just the one.
+			std::vector<dispatch_block> _blocks;
+
+			void _enter(discard_count& count)
+			{
+				if (_count) return;
+				count.enter();
+				_count = &count;
+			}
+
+		public:
+			discard_list() : _count(nullptr) {}
+
+			discard_list(const discard_list&) = delete;
+			discard_list& operator=(const discard_list&) = delete;
+
+			~discard_list()
+			{
+				if (!_count) return;
+				_block.reset();
+				_blocks.clear();
+				_count->leave();
+			}
+
+			// Take a block. Must be called with the queue's lock held.
+			void add(dispatch_block&& block, discard_count& count)
+			{
+				if (!_block) _block = std::move(block);
+				else _blocks.push_back(std::move(block));
+				_enter(count);
+			}
+
+			// Take all the blocks in a vector, leaving it empty. Must be
+			// called with the queue's lock held.
+			void add(std::vector<dispatch_block>& blocks, discard_count& count)
+			{
+				if (blocks.empty()) return;
+				if (blocks.size() == 1 && !_block) {
+					_block = std::move(blocks.front());
+				} else if (_blocks.empty()) {
+					std::swap(_blocks, blocks);
+				} else {
+					for (auto& block : blocks)
+						_blocks.push_back(std::move(block));
+				}
+				blocks.clear();
+				_enter(count);
+			}
+		};
+
+		// The blocks one thread has staged for one queue and qos class.
+		// Only that thread stages blocks, and only stop() takes them, so the
+		// lock is hardly ever contended.
+		struct submission_buffer
+		{
+			std::mutex mutex;
+			const qos level;
+			bool closed; // The queue has stopped, and taken the blocks.
+			std::vector<dispatch_block> blocks;
+
+			explicit submission_buffer(qos level) : level(level), closed(false)
+			{
+			}
+		};
+
+		// A queue's end of the submission caches. A cache holds on to this
+		// rather than to the queue, so that it finds out when the queue has
+		// gone away. Each cache registers its buffers here, so that stop()
+		// can take the blocks every thread has staged.
+		class submission_target
+		{
+			std::mutex _buffers_mutex;
+			std::vector<std::shared_ptr<submission_buffer>> _buffers;
+			bool _closed;
+
+		public:
+			// Held while sending blocks to the queue, and while stop() takes
+			// the staged ones.
+			std::mutex mutex;
+			dispatch_queue* queue; // Null once the queue is destroyed.
+
+			explicit submission_target(dispatch_queue* queue)
+				: _closed(false)
+				, queue(queue)
+			{
+			}
+
+			// Register a buffer. Returns false if the queue has stopped.
+			bool add(const std::shared_ptr<submission_buffer>& buffer)
+			{
+				std::lock_guard<std::mutex> lock(_buffers_mutex);
+				if (_closed) return false;
+				_buffers.push_back(buffer);
+				return true;
+			}
+
+			// Unregister a buffer, unless it still has blocks. A thread can
+			// only be left with some if the queue is stopping, so they stay
+			// for stop() to take, even once the thread has gone.
+			void remove(submission_buffer* buffer)
+			{
+				std::lock_guard<std::mutex> lock(_buffers_mutex);
+				for (auto it = _buffers.begin(); it != _buffers.end(); ++it) {
+					if (it->get() == buffer) {
+						std::lock_guard<std::mutex> lock(buffer->mutex);
+						if (buffer->blocks.empty()) _buffers.erase(it);
+						return;
+					}
+				}
+			}
+
+			// Close every buffer, and hand its blocks to the given function,
+			// with the qos class. Must be called with the mutex held.
+			template <typename Fn> void close(Fn fn)
+			{
+				std::lock_guard<std::mutex> lock(_buffers_mutex);
+				_closed = true;
+				for (auto& buffer : _buffers) {
+					std::lock_guard<std::mutex> lock(buffer->mutex);
+					buffer->closed = true;
+					if (!buffer->blocks.empty())
+						fn(buffer->blocks, buffer->level);
+					buffer->blocks.clear();
+				}
+			}
+		};
+
+		// The handle behind dispatch_queue::native_handle(): an eventfd on
+		// Linux, a kqueue with a user event on macOS, or a manual-reset
+		// event on Windows. It's either signalled or not; signalling it
+		// twice is the same as once. Not thread-safe; the queue's lock
+		// guards it.
+		class wake_event
+		{
+		public:
+#if defined(_WIN32)
+			typedef HANDLE native_type;
+#else
+			typedef int native_type;
+#endif
+
+		private:
+#if defined(_WIN32)
+			HANDLE _handle = nullptr;
+#else
+			int _handle = -1;
+#endif
+
+			static void _fail(const char* what)
+			{
+#if defined(_WIN32)
+				throw std::system_error(
+					int(GetLastError()), std::system_category(), what);
+#elif defined(__linux__) || defined(__APPLE__)
+				throw std::system_error(errno, std::system_category(), what);
+#else
+				throw std::system_error(
+					std::make_error_code(std::errc::function_not_supported),
+					what);
+#endif
+			}
+
+		public:
+			wake_event() = default;
+			wake_event(const wake_event&) = delete;
+			wake_event& operator=(const wake_event&) = delete;
+
+			~wake_event()
+			{
+				if (!valid()) return;
+#if defined(_WIN32)
+				CloseHandle(_handle);
+#else
+				::close(_handle);
+#endif
+			}
+
+			bool valid() const
+			{
+#if defined(_WIN32)
+				return _handle != nullptr;
+#else
+				return _handle >= 0;
+#endif
+			}
+
+			native_type get() const { return _handle; }
+
+			// Create the handle, unsignalled, if it doesn't exist yet.
+			void open()
+			{
+				if (valid()) return;
+#if defined(_WIN32)
+				_handle = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+				if (!_handle) _fail("CreateEvent");
+#elif defined(__linux__)
+				_handle = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+				if (_handle < 0) _fail("eventfd");
+#elif defined(__APPLE__)
+				int kq = kqueue();
+				if (kq < 0) _fail("kqueue");
+				struct kevent ev;
+				EV_SET(&ev, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+				if (kevent(kq, &ev, 1, nullptr, 0, nullptr) < 0) {
+					int error = errno;
+					::close(kq);
+					errno = error;
+					_fail("kevent");
+				}
+				_handle = kq;
+#else
+				_fail("native_handle");
+#endif
+			}
+
+			// One syscall each. Errors are ignored: the only possible ones
+			// are an eventfd counter overflowing, or clearing a handle that
+			// wasn't signalled, and neither loses a wakeup.
+			void signal()
+			{
+#if defined(_WIN32)
+				SetEvent(_handle);
+#elif defined(__linux__)
+				uint64_t one = 1;
+				ssize_t n = ::write(_handle, &one, sizeof one);
+				(void)n;
+#elif defined(__APPLE__)
+				struct kevent ev;
+				EV_SET(&ev, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, nullptr);
+				kevent(_handle, &ev, 1, nullptr, 0, nullptr);
+#endif
+			}
+
+			void clear()
+			{
+#if defined(_WIN32)
+				ResetEvent(_handle);
+#elif defined(__linux__)
+				uint64_t count;
+				ssize_t n = ::read(_handle, &count, sizeof count);
+				(void)n;
+#elif defined(__APPLE__)
+				struct kevent ev;
+				struct timespec zero = { 0, 0 };
+				kevent(_handle, nullptr, 0, &ev, 1, &zero);
+#endif
+			}
+		};
+
+		// Blocks that a thread has dispatched but not yet sent, for each
+		// queue (and qos class) it has dispatched to. Only its own thread
+		// touches a cache, and staging a block only takes its buffer's lock,
+		// which nobody else takes but stop().
+		class submission_cache
+		{
+			struct entry
+			{
+				std::shared_ptr<submission_target> target;
+				std::shared_ptr<submission_buffer> buffer;
+			};
+
+			std::vector<entry> _entries;
+
+			// Blocks staged in all entries. When stop() takes some, this is
+			// too high until the next flush().
+			size_t _pending = 0;
+
+			static submission_cache*& _current()
+			{
+				static thread_local submission_cache* c = nullptr;
+				return c;
+			}
+
+			typedef std::chrono::steady_clock::time_point time_point;
+
+			inline bool _flush(entry& e, time_point deadline);
+
+		public:
+			// The calling thread's cache.
+			static submission_cache& get()
+			{
+				static thread_local submission_cache c;
+				_current() = &c;
+				return c;
+			}
+
+			// Flush the calling thread's cache, if it has one. This is
+			// called after every block, so it's cheap when there's nothing
+			// to flush.
+			static void flush_current()
+			{
+				submission_cache* c = _current();
+				if (c && c->_pending > 0) c->flush();
+			}
+
+			// Stage a block, and send the entry if it has reached the
+			// threshold. Returns false if the queue has stopped.
+			bool stage(
+				const std::shared_ptr<submission_target>& target, qos level,
+				dispatch_block&& block, size_t threshold)
+			{
+				entry* e = nullptr;
+				for (auto& c : _entries) {
+					if (c.target == target && c.buffer->level == level) {
+						e = &c;
+						break;
+					}
+				}
+				if (!e) {
+					auto buffer = std::make_shared<submission_buffer>(level);
+					if (!target->add(buffer)) return false;
+					_entries.push_back(entry { target, buffer });
+					e = &_entries.back();
+				}
+
+				size_t size;
+				{
+					std::lock_guard<std::mutex> lock(e->buffer->mutex);
+					if (e->buffer->closed) return false;
+					e->buffer->blocks.push_back(std::move(block));
+					size = e->buffer->blocks.size();
+				}
+				++_pending;
+				if (size >= threshold) _flush(*e, time_point::max());
+				return true;
+			}
+
+			// Send everything staged for one queue, waiting until the
+			// deadline for room if it's full (time_point::min() means don't
+			// wait). Returns false if blocks are still staged because the
+			// queue is full.
+			bool flush(
+				const submission_target* target,
+				time_point deadline = time_point::max())
+			{
+				bool flushed = true;
+				for (auto& e : _entries)
+					if (e.target.get() == target)
+						flushed = _flush(e, deadline) && flushed;
+				return flushed;
+			}
+
+			// Send everything, and forget queues that have gone away. (If
+			// we hold the only reference to a target, its queue is gone.)
+			void flush()
+			{
+				bool flushed = true;
+				for (auto& e : _entries)
+					flushed = _flush(e, time_point::max()) && flushed;
+				if (flushed) _pending = 0;
+				_entries.erase(
+					std::remove_if(
+						_entries.begin(),
+						_entries.end(),
+						[](const entry& e) {
+							if (e.target.use_count() > 1) return false;
+							e.target->remove(e.buffer.get());
+							return true;
+						}),
+					_entries.end());
+			}
+
+			~submission_cache()
+			{
+				flush();
+				for (auto& e : _entries)
+					e.target->remove(e.buffer.get());
+				_current() = nullptr;
+			}
+		};
+	} // namespace detail
+
+	// -------------------------------------------------------------------------
+	// dispatch_queue: receives blocks, executes them in FIFO order.
+	//
+	// Call dispatch() to add a block to the queue.
+	// Call dispatch_bulk() to add many blocks at once.
+	// Call run_once() or run_forever() to execute queued blocks.
+	// Call stop() to stop accepting new blocks.
+	// Call wait_until_done() to wait until the queue is empty.
+	//
+	// All methods are thread-safe. However, to ensure that blocks are
+	// executed in strict FIFO order, only one thread should call run_*().
+	//
+	// Normally it's easier to use dispatch_thread (below) which handles
+	// threading automatically. This class is useful for integrating into an
+	// existing thread; just call run_once() from your inner loop. If that's
+	// an event loop, wait on native_handle() to find out when there's work.
+	// Give run_once() a budget of blocks or time to bound each iteration.
+	//
+	// Blocks can be given a qos class. Each class has its own FIFO sub-queue,
+	// and higher classes run first: before each lower-priority block, the
+	// consumer checks for higher-priority blocks and runs those instead. To
+	// stop a steady stream of high-priority blocks starving everything else,
+	// after starvation_limit consecutive preemptions one lower-priority block
+	// gets to run anyway.
+	//
+	// Call dispatch_after() to run a block once a deadline has passed, or
+	// dispatch_every() to run one repeatedly. Timers are kept in a timing
+	// wheel and fired by run_once() or run_forever(), which sleeps until the
+	// next timer is due. Timers still pending when the queue is stopped never
+	// fire.
+	//
+	// Pass an idle_policy to the constructor to make run_forever() spin for a
+	// while before it goes to sleep waiting for blocks.
+	//
+	// Call cache_submissions() to batch dispatches automatically. Each
+	// producer thread then stages its blocks in a thread-local cache, and
+	// sends them all at once, taking the lock once per batch, when the cache
+	// reaches the threshold, when the producer calls flush(), and when the
+	// producer finishes running a block of its own (on any queue or pool).
+	// A thread that isn't itself running blocks must call flush(), or its
+	// last few blocks wait until it exits. stop(), and so the destructor,
+	// takes every thread's cached blocks and queues them before it stops,
+	// so every block that dispatch() accepted still runs.
+	//
+	// A queue can be given a capacity, which limits the number of blocks
+	// waiting to be picked up by the consumer. (The consumer may be running up
+	// to that many more.) When the queue is full, dispatch() waits for room,
+	// try_dispatch() fails, and dispatch_for() waits up to a timeout. Or with
+	// overflow_policy::drop_oldest, dispatching never waits; instead the
+	// oldest waiting block of the lowest qos class is thrown away. A block
+	// must never wait for room on its own queue, or it will wait forever.
+	//
+	// The destructor calls stop() and wait_until_done(). Beware that this may
+	// deadlock unless another thread is calling run_once() or run_forever().
+	// (Alternatively, you could call stop() and run_forever() on your main
+	// thread to flush out the queue before destroying it.)
+
+	class dispatch_queue
+	{
+		friend class detail::submission_cache;
+
+	public:
+		static const size_t starvation_limit = 16;
+
+	private:
+		// The members are in groups, with a cache line of padding around
+		// each, so that producers and the consumer don't false-share, and
+		// nor do queues next to each other in memory.
+		detail::cache_pad _pad0;
+
+		// Settings, which everyone reads but which hardly ever change.
+		// _target is set before _cache_threshold, and then never changes;
+		// _cache_threshold is zero unless submissions are cached.
+		size_t _capacity = 0; // Zero means unbounded.
+		overflow_policy _overflow = overflow_policy::block;
+		idle_policy _idle;
+		std::atomic<size_t> _cache_threshold;
+		std::shared_ptr<detail::submission_target> _target;
+		size_t _reserved = 0;
+		detail::cache_pad _pad1;
+
+		block_arena _arena; // Must outlive the blocks below.
+		detail::cache_pad _pad2;
+
+		// The lock, and what it guards. Producers write these on every
+		// dispatch.
+		std::mutex _mutex;
+		std::condition_variable _work; // Signalled when blocks arrive.
+		std::condition_variable _drained; // Signalled when the queue is done.
+		std::condition_variable _space; // Signalled when a full queue isn't.
+		bool _done = false;
+		bool _closing = false; // stop() is taking the cached blocks.
+		bool _busy = false; // Whether the consumer is running a batch.
+		size_t _waiting = 0; // Number of consumers waiting for work.
+		size_t _blocked = 0; // Number of producers waiting for room.
+		size_t _pending = 0; // Blocks in _queue, less any dropped.
+		size_t _drop_count = 0;
+		std::vector<dispatch_block> _discards; // Dropped, to destroy unlocked.
+		detail::discard_count _discarding;
+
+		// The handle for native_handle(), if it's been asked for, and
+		// whether it's signalled. Only the first block to arrive after the
+		// consumer takes a batch signals it.
+		detail::wake_event _wake;
+		bool _signalled = false;
+
+		// One bit for each non-empty sub-queue, plus one for stop(), so that
+		// the consumer can poll for work without taking the lock.
+		static const unsigned ready_done = 1u << qos_count;
+		std::atomic<unsigned> _ready;
+
+		// Blocks are dispatched into _queue. The consumer swaps it with
+		// _batch, runs the batch and clears it. Both vectors keep their
+		// capacity, so after warming up, dispatching doesn't allocate.
+		// There's one of each for every qos class.
+		std::vector<dispatch_block> _queue[qos_count];
+
+		// With drop_oldest, the number of blocks at the front of each
+		// sub-queue that have been dropped. They're destroyed straight away,
+		// leaving empty blocks that the consumer skips, and that are erased
+		// once they outnumber the blocks still waiting.
+		size_t _dropped[qos_count] = {};
+
+		// Timers, and the tick the consumer is sleeping until.
+		// The wheel is several kilobytes, so it's only made when the first
+		// timer is dispatched.
+		std::unique_ptr<detail::timer_wheel> _timers;
+		uint64_t _wake_tick = detail::timer_wheel::never;
+
+#if MORE_DISPATCH_METRICS
+		// When each block in _queue and _batch was dispatched, in
+		// nanoseconds, swapped along with them.
+		std::vector<uint64_t> _enqueued_at[qos_count];
+#endif
+		detail::cache_pad _pad3;
+
+		// The consumer's own state, which it uses outside the lock.
+		std::vector<dispatch_block> _batch[qos_count];
+		size_t _batch_pos[qos_count] = {}; // The next block to run.
+		size_t _preempted[qos_count] = {}; // Consecutive preemptions.
+		std::vector<detail::timer_node*> _fired; // Expired, to be run.
+		std::vector<detail::timer_node*> _repeating; // Run, to be rescheduled.
+#if MORE_DISPATCH_METRICS
+		std::vector<uint64_t> _batch_enqueued_at[qos_count];
+		detail::cache_pad _pad4;
+
+		detail::queue_counters _counters;
+#endif
+		detail::cache_pad _pad5;
+
+		typedef std::chrono::steady_clock::time_point time_point;
+
+		bool _dispatch(
+			dispatch_block&& block, qos level,
+			time_point deadline = time_point::max())
+		{
+			detail::discard_list discards;
+#if MORE_DISPATCH_METRICS
+			detail::metered_lock lock(_mutex, _counters);
+#else
+			std::unique_lock<std::mutex> lock(_mutex);
+#endif
+			bool added = _make_room(lock, deadline);
+			if (added) {
+				std::vector<dispatch_block>& queue = _will_add(level);
+				queue.push_back(std::move(block));
+				_did_add(level, 1);
+			} else {
+				discards.add(std::move(block), _discarding);
+			}
+			discards.add(_discards, _discarding);
+			return added;
+		}
+
+		// Move all the given blocks to the end of a sub-queue, and clear the
+		// vector. Waits for room as _make_room() does, and leaves the vector
+		// intact if there isn't any, or if the queue is stopped. Blocks
+		// dropped to make room go in the discard list.
+		bool _dispatch_bulk(
+			std::vector<dispatch_block>& blocks, qos level,
+			time_point deadline, detail::discard_list& discards)
+		{
+#if MORE_DISPATCH_METRICS
+			detail::metered_lock lock(_mutex, _counters);
+#else
+			std::unique_lock<std::mutex> lock(_mutex);
+#endif
+			bool added = _make_room(lock, deadline);
+			if (added) _append(blocks, level);
+			discards.add(_discards, _discarding);
+			return added;
+		}
+
+		// Move blocks to the end of a sub-queue, regardless of capacity.
+		// Must be called with the lock held.
+		void _append(std::vector<dispatch_block>& blocks, qos level)
+		{
+			if (blocks.empty()) return;
+
+			std::vector<dispatch_block>& queue = _will_add(level);
+			size_t count = blocks.size();
+			if (queue.empty()) {
+				std::swap(queue, blocks);
+			} else {
+				for (auto& block : blocks)
+					queue.push_back(std::move(block));
+			}
+			blocks.clear();
+			_did_add(level, count);
+		}
+
+		// Whether stop() has been called. This doesn't need the lock.
+		bool _stopped() const
+		{
+			return _ready.load(std::memory_order_relaxed) & ready_done;
+		}
+
+		// Send the calling thread's cached blocks, waiting for room until
+		// the deadline. Returns false if some are still cached.
+		bool _flush(time_point deadline)
+		{
+			if (!_target) return true;
+			return detail::submission_cache::get().flush(
+				_target.get(), deadline);
+		}
+
+		// Wait until there's room for another block, or drop one to make
+		// room, depending on the overflow policy. Gives up at the deadline;
+		// time_point::min() means don't wait at all. Returns false if the
+		// queue is still full, or is stopped or stopping.
+		bool _make_room(std::unique_lock<std::mutex>& lock, time_point deadline)
+		{
+			while (!_done && !_closing && _capacity > 0
+				&& _pending >= _capacity) {
+				if (_overflow == overflow_policy::drop_oldest) {
+					_drop_oldest();
+					continue;
+				}
+				if (deadline == time_point::min()) return false;
+
+				++_blocked;
+				if (deadline == time_point::max()) {
+					_space.wait(lock);
+				} else if (
+					_space.wait_until(lock, deadline)
+					== std::cv_status::timeout) {
+					deadline = time_point::min();
+				}
+				--_blocked;
+			}
+			return !_done && !_closing;
+		}
+
+		// Count blocks just added to a sub-queue. A batch only waits for the
+		// queue to have some room, not room for the whole batch, so this might
+		// take the queue over capacity. With drop_oldest, trim it back.
+		void _did_add(qos level, size_t count)
+		{
+#if MORE_DISPATCH_METRICS
+			_enqueued_at[size_t(level)].resize(
+				_queue[size_t(level)].size(), detail::now_ns());
+			_counters.did_enqueue(count);
+#else
+			(void)level;
+#endif
+			_pending += count;
+			if (_overflow == overflow_policy::drop_oldest && _capacity > 0) {
+				while (_pending > _capacity)
+					_drop_oldest();
+			}
+		}
+
+		// Drop the oldest waiting block of the lowest qos class, moving it to
+		// _discards. Must be called with the lock held, and whoever holds it
+		// must hand _discards to a detail::discard_list before releasing it.
+		void _drop_oldest()
+		{
+			for (size_t i = qos_count; i-- > 0;) {
+				std::vector<dispatch_block>& queue = _queue[i];
+				size_t& dropped = _dropped[i];
+				if (dropped < queue.size()) {
+					_discards.push_back(std::move(queue[dropped++]));
+					if (dropped >= queue.size() - dropped) {
+						queue.erase(queue.begin(), queue.begin() + dropped);
+#if MORE_DISPATCH_METRICS
+						_enqueued_at[i].erase(
+							_enqueued_at[i].begin(),
+							_enqueued_at[i].begin() + dropped);
+#endif
+						dropped = 0;
+						if (queue.empty())
+							_ready.fetch_and(
+								~(1u << i), std::memory_order_relaxed);
+					}
+					--_pending;
+					++_drop_count;
+#if MORE_DISPATCH_METRICS
+					_counters.dropped.fetch_add(1, std::memory_order_relaxed);
+#endif
+					return;
+				}
+			}
+		}
+
+		// Mark a sub-queue as non-empty, and return it. Must be called with
+		// the lock held, before adding blocks. Only the first block in a
+		// sub-queue needs to wake the consumer; if it's non-empty, the
+		// consumer has been woken already.
+		//
+		// We notify with the lock held, because once we release it the
+		// block might run, and its owner might destroy the queue.
+		std::vector<dispatch_block>& _will_add(qos level)
+		{
+			size_t i = size_t(level);
+			std::vector<dispatch_block>& queue = _queue[i];
+			if (queue.empty()) {
+				_ready.fetch_or(1u << i, std::memory_order_relaxed);
+				if (_waiting > 0) _work.notify_one();
+				_signal();
+			}
+			return queue;
+		}
+
+		// Signal native_handle(), if anyone is watching it and it isn't
+		// signalled already. Must be called with the lock held.
+		void _signal()
+		{
+			if (_signalled || !_wake.valid()) return;
+			_wake.signal();
+			_signalled = true;
+		}
+
+		bool _queue_empty() const
+		{
+			for (auto& queue : _queue)
+				if (!queue.empty()) return false;
+			return true;
+		}
+
+		bool _batch_empty() const
+		{
+			for (auto& batch : _batch)
+				if (!batch.empty()) return false;
+			return true;
+		}
+
+		// Swap in the next batch of every sub-queue below the given level.
+		// Must be called with the lock held.
+		void _take_batch(size_t levels = qos_count)
+		{
+			if (_signalled && levels == qos_count) {
+				_wake.clear();
+				_signalled = false;
+			}
+			for (size_t i = 0; i < levels; ++i) {
+				std::vector<dispatch_block>& batch = _batch[i];
+				assert(batch.empty());
+				if (batch.capacity() < _reserved) batch.reserve(_reserved);
+				std::swap(batch, _queue[i]);
+#if MORE_DISPATCH_METRICS
+				std::swap(_batch_enqueued_at[i], _enqueued_at[i]);
+#endif
+				_ready.fetch_and(~(1u << i), std::memory_order_relaxed);
+				_pending -= batch.size() - _dropped[i];
+				_batch_pos[i] = _dropped[i];
+				_dropped[i] = 0;
+			}
+			if (_blocked > 0) _space.notify_all();
+			_busy = !_batch_empty();
+			if (!_busy && _done) _drained.notify_all();
+		}
+
+		dispatch_timer _dispatch_timer(
+			detail::timer_node* node,
+			std::chrono::steady_clock::time_point deadline)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				if (!_done) {
+					if (!_timers) _timers.reset(new detail::timer_wheel);
+					node->expiry = _timers->ticks(deadline);
+					if (node->expiry < _timers->next_expiry()) _signal();
+					_timers->insert(node);
+					if (_waiting > 0 && node->expiry < _wake_tick)
+						_work.notify_one();
+					return dispatch_timer(node);
+				}
+			}
+			delete node;
+			return dispatch_timer();
+		}
+
+		// Collect any timers that are due, and put repeating timers that ran
+		// last time back in the wheel. Must be called with the lock held.
+		void _expire_timers()
+		{
+			if (_done || !_timers) return;
+			for (detail::timer_node* node : _repeating)
+				_timers->reschedule(node);
+			_repeating.clear();
+			if (!_timers->empty()) _timers->advance(_timers->now(), _fired);
+		}
+
+		// Run the timers that are due, without the lock.
+		void _run_timers()
+		{
+			for (detail::timer_node* node : _fired) {
+				if (node->fire()) _repeating.push_back(node);
+				else node->release();
+				detail::submission_cache::flush_current();
+			}
+			_fired.clear();
+		}
+
+		// Check whether higher-priority blocks have arrived while we're
+		// running the given level. If so, swap them in and return true.
+		bool _preempt(size_t level)
+		{
+			unsigned higher = (1u << level) - 1;
+			unsigned ready = _ready.load(std::memory_order_relaxed);
+			if (!(ready & higher)) return false;
+			if (++_preempted[level] > starvation_limit) {
+				_preempted[level] = 0;
+				return false;
+			}
+
+			std::lock_guard<std::mutex> lock(_mutex);
+			_take_batch(level);
+			return true;
+		}
+
+		// Run the current batch, highest priority first, then clear it.
+		// Or stop once the budget of blocks runs out, or the deadline has
+		// passed, and leave the rest of the batch for next time. Returns true
+		// if the whole batch ran.
+		bool _run_batch(
+			size_t& budget, time_point deadline = time_point::max())
+		{
+			size_t level = 0;
+			while (level < qos_count) {
+				std::vector<dispatch_block>& batch = _batch[level];
+				size_t& pos = _batch_pos[level];
+				if (pos == batch.size()) {
+					batch.clear();
+#if MORE_DISPATCH_METRICS
+					_batch_enqueued_at[level].clear();
+#endif
+					pos = 0;
+					++level;
+				} else if (level > 0 && _preempt(level)) {
+					level = 0;
+				} else if (
+					budget == 0
+					|| (deadline != time_point::max()
+						&& std::chrono::steady_clock::now() >= deadline)) {
+					return false;
+				} else {
+					// This block wasn't preempted, so any run of
+					// preemptions is over.
+					_preempted[level] = 0;
+					_run_block(level, pos++);
+					detail::submission_cache::flush_current();
+					--budget;
+				}
+			}
+			return true;
+		}
+
+		// The number of blocks left in the batch.
+		size_t _batch_left() const
+		{
+			size_t left = 0;
+			for (size_t i = 0; i < qos_count; ++i)
+				left += _batch[i].size() - _batch_pos[i];
+			return left;
+		}
+
+		void _run_block(size_t level, size_t pos)
+		{
+#if MORE_DISPATCH_METRICS
+			uint64_t start = detail::now_ns();
+			uint64_t enqueued = _batch_enqueued_at[level][pos];
+			_counters.wait.record(start - std::min(start, enqueued));
+			_batch[level][pos].invoke_and_destroy();
+			_counters.run.record(detail::now_ns() - start);
+			_counters.executed.fetch_add(1, std::memory_order_relaxed);
+#else
+			_batch[level][pos].invoke_and_destroy();
+#endif
+		}
+
+	public:
+		explicit dispatch_queue(idle_policy idle = idle_policy())
+			: _idle(idle)
+			, _cache_threshold(0)
+			, _ready(0)
+		{
+		}
+
+		// Make a bounded queue, which holds at most capacity waiting blocks.
+		explicit dispatch_queue(
+			size_t capacity,
+			overflow_policy overflow = overflow_policy::block,
+			idle_policy idle = idle_policy())
+			: _capacity(capacity)
+			, _overflow(overflow)
+			, _idle(idle)
+			, _cache_threshold(0)
+			, _ready(0)
+		{
+		}
+
+		dispatch_queue(const dispatch_queue&) = delete;
+		dispatch_queue& operator=(const dispatch_queue&) = delete;
+
+		// Queue a lambda expression or functor for execution.
+		// Returns true on success, false if the queue is stopped.
+		template <typename F> bool dispatch(F&& lambda)
+		{
+			return dispatch(qos::normal, std::forward<F>(lambda));
+		}
+
+		// Make an awaitable that resumes a coroutine on this queue, as in
+		// co_await queue.schedule(). Needs more_dispatch/coroutine.h.
+		template <typename Self = dispatch_queue>
+		detail::schedule_awaitable<Self> schedule()
+		{
+			return detail::schedule_awaitable<Self>(*this);
+		}
+
+		// Queue a block with the given qos class.
+		template <typename F> bool dispatch(qos level, F&& lambda)
+		{
+			size_t threshold = _cache_threshold.load(std::memory_order_acquire);
+			if (threshold > 0) {
+				if (_stopped()) return false;
+
+				// Cached blocks might outlive the queue, so they can't use
+				// its arena.
+				return detail::submission_cache::get().stage(
+					_target,
+					level,
+					dispatch_block(std::forward<F>(lambda)),
+					threshold);
+			}
+			return _dispatch(
+				dispatch_block(std::forward<F>(lambda), _arena), level);
+		}
+
+		// Queue a block, unless the queue is full. Never waits.
+		// Returns true on success, false if the queue is full or stopped.
+		template <typename F> bool try_dispatch(F&& lambda)
+		{
+			return try_dispatch(qos::normal, std::forward<F>(lambda));
+		}
+
+		template <typename F> bool try_dispatch(qos level, F&& lambda)
+		{
+			if (!_flush(time_point::min())) return false;
+			return _dispatch(
+				dispatch_block(std::forward<F>(lambda), _arena),
+				level,
+				time_point::min());
+		}
+
+		// Queue a block, waiting up to the given time for room if the queue
+		// is full. Returns true on success, false on timeout or if the queue
+		// is stopped.
+		template <typename Rep, typename Period, typename F>
+		bool
+		dispatch_for(std::chrono::duration<Rep, Period> timeout, F&& lambda)
+		{
+			return dispatch_for(timeout, qos::normal, std::forward<F>(lambda));
+		}
+
+		template <typename Rep, typename Period, typename F>
+		bool dispatch_for(
+			std::chrono::duration<Rep, Period> timeout, qos level, F&& lambda)
+		{
+			time_point deadline =
+				std::chrono::time_point_cast<time_point::duration>(
+					std::chrono::steady_clock::now() + timeout);
+			if (!_flush(deadline)) return false;
+			return _dispatch(
+				dispatch_block(std::forward<F>(lambda), _arena),
+				level,
+				deadline);
+		}
+
+		// Queue every functor in the range [begin, end), moving them out of
+		// the range. Returns true on success, false if the queue is stopped.
+		template <typename It>
+		bool dispatch_bulk(It begin, It end, qos level = qos::normal)
+		{
+			flush();
+			detail::discard_list discards;
+#if MORE_DISPATCH_METRICS
+			detail::metered_lock lock(_mutex, _counters);
+#else
+			std::unique_lock<std::mutex> lock(_mutex);
+#endif
+			bool added = _make_room(lock, time_point::max());
+			if (added && begin != end) {
+				std::vector<dispatch_block>& queue = _will_add(level);
+				size_t size = queue.size();
+				for (It it = begin; it != end; ++it)
+					queue.emplace_back(std::move(*it));
+				_did_add(level, queue.size() - size);
+			}
+			discards.add(_discards, _discarding);
+			return added;
+		}
+
+		// Queue all the blocks in a batch, and clear it.
+		// Returns true on success, false (leaving the batch intact) if the
+		// queue is stopped.
+		bool dispatch_bulk(dispatch_batch& batch, qos level = qos::normal)
+		{
+			flush();
+			detail::discard_list discards;
+			return _dispatch_bulk(
+				batch._blocks, level, time_point::max(), discards);
+		}
+
+		// Run a block once the given time has passed. Returns a handle that
+		// can cancel it, which is invalid if the queue is stopped.
+		template <typename F>
+		dispatch_timer dispatch_after(
+			std::chrono::steady_clock::time_point deadline, F&& lambda)
+		{
+			return _dispatch_timer(
+				new detail::timer_node(std::forward<F>(lambda), 0, 0),
+				deadline);
+		}
+
+		// Run a block after the given delay.
+		template <typename Rep, typename Period, typename F>
+		dispatch_timer
+		dispatch_after(std::chrono::duration<Rep, Period> delay, F&& lambda)
+		{
+			return dispatch_after(
+				std::chrono::steady_clock::now() + delay,
+				std::forward<F>(lambda));
+		}
+
+		// Run a block repeatedly, at the given interval, starting one
+		// interval from now. If the consumer falls behind, missed runs are
+		// skipped rather than run late.
+		template <typename Rep, typename Period, typename F>
+		dispatch_timer
+		dispatch_every(std::chrono::duration<Rep, Period> interval, F&& lambda)
+		{
+			uint64_t period =
+				std::max<uint64_t>(detail::timer_wheel::ticks(interval), 1);
+			auto deadline = std::chrono::steady_clock::now() + interval;
+			return _dispatch_timer(
+				new detail::timer_node(std::forward<F>(lambda), 0, period),
+				deadline);
+		}
+
+		// Whether there are no blocks waiting to run. Blocks that are running
+		// right now don't count.
+		bool empty()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _queue_empty();
+		}
+
+		// The maximum number of waiting blocks, or zero if unbounded.
+		size_t capacity() const { return _capacity; }
+
+		// The number of blocks thrown away by overflow_policy::drop_oldest.
+		size_t dropped()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _drop_count;
+		}
+
+		// How much of the queue's block_arena is in use.
+		arena_stats arena_usage() const { return _arena.stats(); }
+
+#if MORE_DISPATCH_METRICS
+		// A snapshot of the queue's counters and latency histograms. This
+		// doesn't take the lock, so it's cheap enough to scrape often.
+		queue_metrics metrics() const { return _counters.snapshot(); }
+#endif
+
+		// Cache the blocks dispatched by each thread, and send them in
+		// batches of up to the given size. Zero turns caching off. Call this
+		// before other threads start dispatching. try_dispatch() and
+		// dispatch_for() never cache, but flush the calling thread's cache
+		// first, to keep its blocks in order. They don't wait for room any
+		// longer than they would otherwise, and fail if the cached blocks
+		// don't fit.
+		void cache_submissions(size_t threshold)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				if (!_target)
+					_target = std::make_shared<detail::submission_target>(this);
+			}
+			_cache_threshold.store(threshold, std::memory_order_release);
+		}
+
+		// Send any blocks the calling thread has cached for this queue.
+		void flush() { _flush(time_point::max()); }
+
+		// Preallocate room for the given number of blocks, so that batches
+		// up to that size never need to reallocate.
+		void reserve(size_t blocks)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_reserved = std::max(_reserved, blocks);
+			for (auto& queue : _queue)
+				queue.reserve(_reserved);
+#if MORE_DISPATCH_METRICS
+			for (auto& times : _enqueued_at)
+				times.reserve(_reserved);
+#endif
+		}
+
+		// Stop accepting new blocks. dispatch() will now return false.
+		// This method is idempotent; it's safe to call it multiple times.
+		void stop()
+		{
+			detail::discard_list discards;
+			std::vector<dispatch_block> cached[qos_count];
+			std::unique_lock<std::mutex> target_lock;
+			if (_target) {
+				// Every thread's cached blocks were accepted, so they go in
+				// before we stop. First make anyone sending them give up
+				// waiting for room, so that we can take the target's lock.
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+					if (_done) return;
+					_closing = true;
+					_space.notify_all();
+				}
+				target_lock = std::unique_lock<std::mutex>(_target->mutex);
+				_target->close(
+					[&cached](std::vector<dispatch_block>& blocks, qos level) {
+						std::vector<dispatch_block>& to = cached[size_t(level)];
+						for (auto& block : blocks)
+							to.push_back(std::move(block));
+					});
+			}
+
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (!_done) {
+				// This mustn't wait for room, in case we're called from a
+				// block on this queue, so it may take a bounded queue over
+				// capacity.
+				for (size_t i = 0; i < qos_count; ++i)
+					_append(cached[i], qos(i));
+				discards.add(_discards, _discarding);
+			}
+			_done = true;
+			_ready.fetch_or(ready_done, std::memory_order_relaxed);
+			_work.notify_all();
+			_space.notify_all();
+			_signal();
+			if (_queue_empty() && !_busy) _drained.notify_all();
+		}
+
+		// Wait until the queue is stopped and all outstanding blocks have run.
+		void wait_until_done()
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			while (!_done || !_queue_empty() || _busy)
+				_drained.wait(lock);
+		}
+
+		// Grab some blocks from the queue, if any are available, and run them.
+		// Don't call this (or run_forever) from a block on the same queue.
+		void run_once() { run_once(size_t(-1)); }
+
+		// Like run_once(), but within a budget: stop after running
+		// max_blocks blocks, or once max_duration has passed (checked after
+		// each block). The rest of the batch stays at the front of the
+		// queue, and runs first next time, so blocks still run in order.
+		// Timers that are due always fire. Returns the number of blocks
+		// still waiting, so the caller can adjust its budget.
+		//
+		// If native_handle() is in use, it's left signalled while blocks
+		// are waiting.
+		size_t run_once(
+			size_t max_blocks,
+			std::chrono::steady_clock::duration max_duration =
+				std::chrono::steady_clock::duration::max())
+		{
+			time_point deadline = time_point::max();
+			if (max_duration != std::chrono::steady_clock::duration::max())
+				deadline = std::chrono::steady_clock::now() + max_duration;
+
+			bool resumed;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_expire_timers();
+				resumed = !_batch_empty();
+				if (!resumed) _take_batch();
+				if (!_fired.empty()) _busy = true;
+				if (!_busy) return 0;
+			}
+
+			// If we finish what was left last time, with budget to spare,
+			// carry on with a new batch.
+			_run_timers();
+			bool finished = _run_batch(max_blocks, deadline);
+			if (finished && resumed) {
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+					_take_batch();
+				}
+				finished = _run_batch(max_blocks, deadline);
+			}
+
+			std::lock_guard<std::mutex> lock(_mutex);
+			size_t left = _pending;
+			if (finished) {
+				_busy = false;
+				if (_done && _queue_empty()) _drained.notify_all();
+			} else {
+				left += _batch_left();
+			}
+			if (left > 0) _signal();
+			return left;
+		}
+
+		typedef detail::wake_event::native_type native_handle_type;
+
+		// A handle for integrating run_once() into an event loop: an eventfd
+		// on Linux, a kqueue on macOS (both readable when signalled), or an
+		// event object on Windows. It's signalled when blocks arrive, when a
+		// timer is added that's due sooner than the others, and when the
+		// queue is stopped. run_once() resets it. Signals are coalesced, so
+		// a burst of dispatches costs one syscall, and each wakeup one more.
+		//
+		// The handle is created on first use; until then, dispatching does
+		// no extra work. It belongs to the queue, so don't close it. Throws
+		// std::system_error if it can't be created, or on other platforms.
+		native_handle_type native_handle()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (!_wake.valid()) {
+				_wake.open();
+				if (!_queue_empty() || _done) _signal();
+			}
+			return _wake.get();
+		}
+
+		// When the next timer is due, or time_point::max() if there are no
+		// timers. An event loop should call run_once() by then, even if
+		// native_handle() isn't signalled. Call this from the thread that
+		// calls run_once().
+		time_point next_timer()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (_done || !_timers) return time_point::max();
+			for (detail::timer_node* node : _repeating)
+				_timers->reschedule(node);
+			_repeating.clear();
+			uint64_t tick = _timers->next_expiry();
+			if (tick == detail::timer_wheel::never) return time_point::max();
+			return _timers->time(tick);
+		}
+
+		// Run blocks as they arrive. Will not return until stop() is called.
+		// When it does return, the queue is guaranteed to be stopped and empty.
+		// This method should typically be called from a background thread.
+		void run_forever()
+		{
+			while (true) {
+				_idle.poll([this] {
+					return _ready.load(std::memory_order_relaxed) != 0;
+				});
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					_busy = false;
+					while (true) {
+						_expire_timers();
+						bool work = !_batch_empty() || !_queue_empty()
+							|| !_fired.empty();
+						if (work || _done) break;
+						_wake_tick = detail::timer_wheel::never;
+						if (_timers) _wake_tick = _timers->next_expiry();
+						++_waiting;
+						if (_wake_tick == detail::timer_wheel::never)
+							_work.wait(lock);
+						else
+							_work.wait_until(lock, _timers->time(_wake_tick));
+						--_waiting;
+					}
+					if (_batch_empty()) _take_batch();
+					else _busy = true;
+					if (!_fired.empty()) _busy = true;
+					if (!_busy) {
+						assert(_done);
+						return;
+					}
+				}
+
+				size_t budget = size_t(-1);
+				_run_timers();
+				_run_batch(budget);
+			}
+		}
+
+		// Destructor. Stops the queue and waits for outstanding blocks to run.
+		~dispatch_queue()
+		{
+			stop();
+			if (_target) {
+				std::lock_guard<std::mutex> lock(_target->mutex);
+				_target->queue = nullptr;
+			}
+			wait_until_done();
+			_discarding.wait();
+			for (detail::timer_node* node : _repeating)
+				node->release();
+		}
+	};
+
+	namespace detail
+	{
+		// Hold the target's lock while sending, so that the queue can't be
+		// destroyed part-way through, and stop() can't take the blocks while
+		// they're on their way. If the queue is full, or stopping, they go
+		// back in the buffer. stop() takes every buffer's blocks, so any for
+		// a queue that has stopped must have been on their way when it did,
+		// and they're dropped, as they are if the queue has gone away.
+		inline bool submission_cache::_flush(entry& e, time_point deadline)
+		{
+			// Declared before the lock, so that dropped blocks are destroyed
+			// after it's released.
+			discard_list discards;
+			std::vector<dispatch_block> blocks;
+			std::lock_guard<std::mutex> lock(e.target->mutex);
+			{
+				std::lock_guard<std::mutex> lock(e.buffer->mutex);
+				if (e.buffer->blocks.empty()) return true;
+				std::swap(blocks, e.buffer->blocks);
+			}
+
+			size_t count = blocks.size();
+			dispatch_queue* queue = e.target->queue;
+			bool sent = !queue
+				|| queue->_dispatch_bulk(
+					blocks, e.buffer->level, deadline, discards)
+				|| queue->_stopped();
+
+			// Only this thread stages blocks, so the buffer is still empty.
+			// Put the blocks back if they weren't sent, or else give it the
+			// empty vector the queue swapped in, to save reallocating.
+			if (!sent || blocks.empty()) {
+				std::lock_guard<std::mutex> lock(e.buffer->mutex);
+				std::swap(blocks, e.buffer->blocks);
+			}
+			if (!sent) return false;
+			_pending -= std::min(_pending, count);
+			return true;
+		}
+	} // namespace detail
+
+	// -------------------------------------------------------------------------
+	// ring_dispatch_queue: a lock-free alternative to dispatch_queue.
+	//
+	// This has the same interface and the same contract as dispatch_queue, but
+	// blocks are stored in a fixed-size ring buffer rather than a vector behind
+	// a mutex. dispatch() costs one compare-and-swap and one store, plus a
+	// mutex and a notify only when the consumer is asleep.
+	//
+	// Any number of threads may call dispatch() concurrently, but only one
+	// thread may call run_*() at a time (multi-producer, single-consumer).
+	//
+	// If the ring is full, dispatch() yields until the consumer makes room.
+	// So a block must never dispatch more blocks to its own queue than the
+	// ring can hold, or it will wait forever.
+	//
+	// Like dispatch_queue, this takes an optional idle_policy.
+
+	class ring_dispatch_queue
+	{
+		struct cell
+		{
+			std::atomic<size_t> _sequence;
+			dispatch_block _block; // Empty unless the cell is in use.
+		};
+
+		// The high bit of _tail is set when the queue is stopped, so that
+		// producers can check for it and claim a cell in a single operation.
+		static const size_t closed = ~(~size_t(0) >> 1);
+
+		// Like dispatch_queue, the members are padded into groups: settings,
+		// then what the producers write, what the consumer writes, and the
+		// slow path for sleeping and waking.
+		detail::cache_pad _pad0;
+
+		block_arena _arena; // Must outlive the cells.
+		std::unique_ptr<cell[]> _cells;
+		size_t _mask;
+		idle_policy _idle;
+		detail::cache_pad _pad1;
+
+		std::atomic<size_t> _tail; // Next cell to be claimed by a producer.
+
+		// The number of threads inside dispatch(). A producer still needs the
+		// queue for a moment after its block is visible, to wake the
+		// consumer, so the destructor waits for this to drop to zero.
+		std::atomic<size_t> _producers;
+		detail::cache_pad _pad2;
+
+		std::atomic<size_t> _head; // Next cell to be run by the consumer.
+		detail::cache_pad _pad3;
+
+		std::mutex _mutex;
+		std::condition_variable _cond; // Signalled when the consumer wakes.
+		std::condition_variable _drained; // Signalled when the queue is done.
+		std::atomic<bool> _sleeping;
+		detail::cache_pad _pad4;
+
+		struct producer_scope
+		{
+			std::atomic<size_t>& _producers;
+
+			producer_scope(std::atomic<size_t>& producers)
+				: _producers(producers)
+			{
+				_producers.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			~producer_scope()
+			{
+				_producers.fetch_sub(1, std::memory_order_release);
+			}
+		};
+
+		// Claim a cell and move the block into it.
+		bool _push(dispatch_block&& block)
+		{
+			size_t pos = _tail.load(std::memory_order_relaxed);
+			cell* c;
+			while (true) {
+				if (pos & closed) return false;
+				c = &_cells[pos & _mask];
+				size_t seq = c->_sequence.load(std::memory_order_acquire);
+				if (seq == pos) {
+					if (_tail.compare_exchange_weak(
+							pos, pos + 1, std::memory_order_relaxed))
+						break;
+				} else if (seq < pos) {
+					// The ring is full. Wait for the consumer to catch up.
+					// Wake it up first, in case it's asleep with a batch we
+					// haven't told it about yet.
+					if (_sleeping.load(std::memory_order_seq_cst)) _wake();
+					std::this_thread::yield();
+					pos = _tail.load(std::memory_order_relaxed);
+				} else {
+					pos = _tail.load(std::memory_order_relaxed);
+				}
+			}
+
+			// This is sequentially consistent to pair with _wait(): either
+			// we see that the consumer is asleep, or it sees our block.
+			c->_block = std::move(block);
+			c->_sequence.store(pos + 1, std::memory_order_seq_cst);
+			return true;
+		}
+
+		void _notify()
+		{
+			if (_sleeping.load(std::memory_order_seq_cst)) _wake();
+		}
+
+		bool _dispatch(dispatch_block&& block)
+		{
+			producer_scope scope(_producers);
+			if (!_push(std::move(block))) {
+				// Refused, so destroy the block before the destructor can
+				// free the arena it might be using.
+				block.reset();
+				return false;
+			}
+			_notify();
+			return true;
+		}
+
+		void _wake()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_sleeping.store(false, std::memory_order_relaxed);
+			_cond.notify_one();
+		}
+
+		bool _ready(size_t head)
+		{
+			cell& c = _cells[head & _mask];
+			return c._sequence.load(std::memory_order_acquire) == head + 1;
+		}
+
+		bool _is_done(size_t head)
+		{
+			size_t tail = _tail.load(std::memory_order_acquire);
+			return (tail & closed) && head == (tail & ~closed);
+		}
+
+		// Run the blocks that were queued before we started.
+		// Returns the number of blocks run.
+		size_t _run_ready()
+		{
+			size_t head = _head.load(std::memory_order_relaxed);
+			size_t end = _tail.load(std::memory_order_acquire) & ~closed;
+			size_t count = 0;
+			for (; head != end && _ready(head); ++head, ++count) {
+				// Move the block out of its cell before running it, so the
+				// cell is free for the block to dispatch into.
+				cell& c = _cells[head & _mask];
+				dispatch_block block(std::move(c._block));
+				c._sequence.store(head + _mask + 1, std::memory_order_release);
+				_head.store(head + 1, std::memory_order_release);
+
+				block.invoke_and_destroy();
+				detail::submission_cache::flush_current();
+			}
+			return count;
+		}
+
+		// Sleep until a block is ready or the queue is done.
+		void _wait()
+		{
+			size_t head = _head.load(std::memory_order_relaxed);
+			bool ready = _idle.poll(
+				[this, head] { return _ready(head) || _is_done(head); });
+			if (ready) return;
+			cell& c = _cells[head & _mask];
+			_sleeping.store(true, std::memory_order_seq_cst);
+			size_t seq = c._sequence.load(std::memory_order_seq_cst);
+			if (seq != head + 1 && !_is_done(head)) {
+				std::unique_lock<std::mutex> lock(_mutex);
+				while (_sleeping.load(std::memory_order_relaxed)
+					   && !_ready(head) && !_is_done(head))
+					_cond.wait(lock);
+			}
+			_sleeping.store(false, std::memory_order_relaxed);
+		}
+
+		void _notify_done()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_drained.notify_all();
+		}
+
+	public:
+		// Create a queue that can hold the given number of blocks. This is
+		// rounded up to a power of two.
+		explicit ring_dispatch_queue(
+			size_t capacity = 1024, idle_policy idle = idle_policy())
+			: _idle(idle)
+			, _tail(0)
+			, _producers(0)
+			, _head(0)
+			, _sleeping(false)
+		{
+			size_t size = 1;
+			while (size < capacity)
+				size *= 2;
+			_cells.reset(new cell[size]);
+			_mask = size - 1;
+			for (size_t i = 0; i < size; ++i)
+				_cells[i]._sequence.store(i, std::memory_order_relaxed);
+		}
+
+		ring_dispatch_queue(const ring_dispatch_queue&) = delete;
+		ring_dispatch_queue& operator=(const ring_dispatch_queue&) = delete;
+
+		// The maximum number of blocks the queue can hold.
+		size_t capacity() const { return _mask + 1; }
+
+		// How much of the queue's block_arena is in use.
+		arena_stats arena_usage() const { return _arena.stats(); }
+
+		// Queue a lambda expression or functor for execution.
+		// Returns true on success, false if the queue is stopped.
+		template <typename F> bool dispatch(F&& lambda)
+		{
+			return _dispatch(dispatch_block(std::forward<F>(lambda), _arena));
+		}
+
+		// Make an awaitable that resumes a coroutine on this queue, as in
+		// co_await queue.schedule(). Needs more_dispatch/coroutine.h.
+		template <typename Self = ring_dispatch_queue>
+		detail::schedule_awaitable<Self> schedule()
+		{
+			return detail::schedule_awaitable<Self>(*this);
+		}
+
+		// Queue every functor in the range [begin, end), moving them out of
+		// the range. Returns true on success, false if the queue is stopped.
+		// If it's stopped part-way through, the remaining blocks are lost.
+		template <typename It> bool dispatch_bulk(It begin, It end)
+		{
+			producer_scope scope(_producers);
+			bool success = true;
+			for (It it = begin; success && it != end; ++it)
+				success = _push(dispatch_block(std::move(*it)));
+			_notify();
+			return success;
+		}
+
+		// Queue all the blocks in a batch, and clear it.
+		// Returns true on success, false if the queue is stopped.
+		bool dispatch_bulk(dispatch_batch& batch)
+		{
+			std::vector<dispatch_block>& blocks = batch._blocks;
+			producer_scope scope(_producers);
+			bool success = true;
+			for (auto it = blocks.begin(); success && it != blocks.end(); ++it)
+				success = _push(std::move(*it));
+			_notify();
+			blocks.clear();
+			return success;
+		}
+
+		// Stop accepting new blocks. dispatch() will now return false.
+		// This method is idempotent; it's safe to call it multiple times.
+		void stop()
+		{
+			_tail.fetch_or(closed);
+			std::lock_guard<std::mutex> lock(_mutex);
+			_sleeping.store(false, std::memory_order_relaxed);
+			_cond.notify_all();
+			_drained.notify_all();
+		}
+
+		// Wait until the queue is stopped and all outstanding blocks have run.
+		void wait_until_done()
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			while (!_is_done(_head.load(std::memory_order_acquire)))
+				_drained.wait(lock);
+		}
+
+		// Grab some blocks from the queue, if any are available, and run them.
+		void run_once()
+		{
+			if (_run_ready() == 0 && _is_done(_head.load())) _notify_done();
+		}
+
+		// Run blocks as they arrive. Will not return until stop() is called.
+		// When it does return, the queue is guaranteed to be stopped and empty.
+		// This method should typically be called from a background thread.
+		void run_forever()
+		{
+			while (true) {
+				if (_run_ready() > 0) continue;
+				if (_is_done(_head.load())) {
+					_notify_done();
+					return;
+				}
+				_wait();
+			}
+		}
+
+		// Destructor. Stops the queue and waits for outstanding blocks to run.
+		~ring_dispatch_queue()
+		{
+			stop();
+			wait_until_done();
+			while (_producers.load(std::memory_order_acquire) > 0)
+				std::this_thread::yield();
+		}
+	};
+
+	// -------------------------------------------------------------------------
+	// thread_options: how to start the thread of a dispatch_thread, or each
+	// worker of a dispatch_pool.
+	//
+	// The new thread applies the options to itself before it runs any
+	// blocks. They're all best-effort: an option the platform doesn't support,
+	// or the process isn't permitted to use, is skipped. (For example, the
+	// realtime policies on Linux need CAP_SYS_NICE, and macOS has no way to
+	// pin a thread to a CPU.)
+	//
+	// Setting numa_node pins the thread to that node's CPUs, which on Linux
+	// are read from /sys/devices/system/node. Memory the thread touches first
+	// is then allocated on the same node. Call numa_worker_options() to spread
+	// a pool's workers over every node.
+
+	enum class sched_policy
+	{
+		inherit, // Keep the creating thread's policy.
+		other, // The normal time-sharing policy.
+		batch, // Time-sharing, for CPU-bound work. Linux only.
+		idle, // Run only when nothing else wants to. Linux only.
+		fifo, // Realtime, first in first out, at the given priority.
+		round_robin, // Realtime with time slices, at the given priority.
+	};
+
+	struct thread_options
+	{
+		std::vector<unsigned> cpus; // CPUs to run on. Empty means any.
+		int numa_node = -1; // If cpus is empty, run on this node's CPUs.
+		std::string name; // Linux truncates this to 15 characters.
+		size_t stack_size = 0; // Zero means the platform's default.
+		sched_policy policy = sched_policy::inherit;
+		int priority = 0; // For the realtime policies.
+	};
+
+	namespace detail
+	{
+		// Read a Linux CPU or node list, like "0-3,8-11". Returns an empty
+		// list if the file can't be read.
+		inline std::vector<unsigned> read_id_list(const char* path)
+		{
+			std::vector<unsigned> ids;
+			FILE* file = fopen(path, "r");
+			if (!file) return ids;
+			unsigned first, last;
+			while (fscanf(file, "%u", &first) == 1) {
+				last = first;
+				int c = fgetc(file);
+				if (c == '-') {
+					if (fscanf(file, "%u", &last) != 1) break;
+					c = fgetc(file);
+				}
+				for (unsigned id = first; id <= last; ++id)
+					ids.push_back(id);
+				if (c != ',') break;
+			}
+			fclose(file);
+			return ids;
+		}
+
+		// The CPUs of a NUMA node, or an empty list if that's unknown.
+		inline std::vector<unsigned> numa_node_cpus(int node)
+		{
+#if defined(__linux__)
+			char path[64];
+			snprintf(
+				path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+				node);
+			return read_id_list(path);
+#else
+			(void)node;
+			return std::vector<unsigned>();
+#endif
+		}
+
+		inline bool set_thread_affinity(const std::vector<unsigned>& cpus)
+		{
+#if defined(_WIN32)
+			DWORD_PTR mask = 0;
+			for (unsigned cpu : cpus)
+				if (cpu < sizeof(mask) * 8) mask |= DWORD_PTR(1) << cpu;
+			return mask && SetThreadAffinityMask(GetCurrentThread(), mask);
+#elif defined(__linux__)
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			for (unsigned cpu : cpus)
+				if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+			return pthread_setaffinity_np(pthread_self(), sizeof(set), &set)
+				== 0;
+#else
+			(void)cpus;
+			return false;
+#endif
+		}
+
+		inline bool set_thread_name(const std::string& name)
+		{
+#if defined(__linux__)
+			return pthread_setname_np(
+					   pthread_self(), name.substr(0, 15).c_str())
+				== 0;
+#elif defined(__APPLE__)
+			return pthread_setname_np(name.c_str()) == 0;
+#else
+			(void)name;
+			return false;
+#endif
+		}
+
+		inline bool set_thread_policy(sched_policy policy, int priority)
+		{
+#if defined(__linux__) || defined(__APPLE__)
+			int native;
+			switch (policy) {
+			case sched_policy::inherit: return true;
+			case sched_policy::other: native = SCHED_OTHER; break;
+#if defined(SCHED_BATCH) && defined(SCHED_IDLE)
+			case sched_policy::batch: native = SCHED_BATCH; break;
+			case sched_policy::idle: native = SCHED_IDLE; break;
+#endif
+			case sched_policy::fifo: native = SCHED_FIFO; break;
+			case sched_policy::round_robin: native = SCHED_RR; break;
+			default: return false;
+			}
+			sched_param param = {};
+			if (native == SCHED_FIFO || native == SCHED_RR)
+				param.sched_priority = priority;
+			return pthread_setschedparam(pthread_self(), native, &param) == 0;
+#else
+			(void)priority;
+			return policy == sched_policy::inherit;
+#endif
+		}
+
+		// Apply the options to the current thread. Returns false if any of
+		// them couldn't be applied.
+		inline bool apply_thread_options(const thread_options& options)
+		{
+			bool ok = true;
+			std::vector<unsigned> cpus = options.cpus;
+			if (cpus.empty() && options.numa_node >= 0) {
+				cpus = numa_node_cpus(options.numa_node);
+				ok = !cpus.empty();
+			}
+			if (!cpus.empty()) ok = set_thread_affinity(cpus) && ok;
+			if (!options.name.empty()) {
+				ok = set_thread_name(options.name) && ok;
+#if MORE_DISPATCH_TRACING
+				trace_thread_name(options.name.c_str());
+#endif
+			}
+			ok = set_thread_policy(options.policy, options.priority) && ok;
+			return ok;
+		}
+
+		// A thread started with thread_options. On POSIX systems this is a
+		// pthread, so that it can have its own stack size; elsewhere it's a
+		// std::thread, and the stack size is ignored.
+		class os_thread
+		{
+			template <typename F> struct start_data
+			{
+				thread_options options;
+				F function;
+			};
+
+#if defined(__linux__) || defined(__APPLE__)
+			pthread_t _thread;
+			bool _joinable = false;
+
+			template <typename F> static void* _run(void* arg)
+			{
+				std::unique_ptr<start_data<F>> data(
+					static_cast<start_data<F>*>(arg));
+				apply_thread_options(data->options);
+				data->function();
+				return nullptr;
+			}
+#else
+			std::thread _thread;
+#endif
+
+		public:
+			os_thread() = default;
+			os_thread(const os_thread&) = delete;
+			os_thread& operator=(const os_thread&) = delete;
+
+			// Start the thread running a function. Throws std::system_error
+			// if it can't be started, like std::thread.
+			template <typename F>
+			void start(const thread_options& options, F&& function)
+			{
+				typedef start_data<typename std::decay<F>::type> data_type;
+				std::unique_ptr<data_type> data(
+					new data_type { options, std::forward<F>(function) });
+#if defined(__linux__) || defined(__APPLE__)
+				pthread_attr_t attr;
+				pthread_attr_init(&attr);
+				if (options.stack_size > 0) {
+					size_t size = std::max<size_t>(
+						options.stack_size, size_t(PTHREAD_STACK_MIN));
+					pthread_attr_setstacksize(&attr, size);
+				}
+				int error = pthread_create(
+					&_thread,
+					&attr,
+					&os_thread::_run<typename std::decay<F>::type>,
+					data.get());
+				pthread_attr_destroy(&attr);
+				if (error) {
+					throw std::system_error(
+						error, std::generic_category(), "pthread_create");
+				}
+				data.release();
+				_joinable = true;
+#else
+				_thread = std::thread([](std::unique_ptr<data_type> data) {
+					apply_thread_options(data->options);
+					data->function();
+				}, std::move(data));
+#endif
+			}
+
+			void join()
+			{
+#if defined(__linux__) || defined(__APPLE__)
+				if (_joinable) pthread_join(_thread, nullptr);
+				_joinable = false;
+#else
+				if (_thread.joinable()) _thread.join();
+#endif
+			}
+
+			~os_thread() { assert(!joinable()); }
+
+			bool joinable() const
+			{
+#if defined(__linux__) || defined(__APPLE__)
+				return _joinable;
+#else
+				return _thread.joinable();
+#endif
+			}
+		};
+
+		template <typename... Args>
+		struct starts_with_thread_options : std::false_type
+		{
+		};
+
+		template <typename First, typename... Rest>
+		struct starts_with_thread_options<First, Rest...>
+			: std::is_same<typename std::decay<First>::type, thread_options>
+		{
+		};
+	} // namespace detail
+
+	// The system's NUMA nodes, such as { 0, 1 }. Just { 0 } if there's only
+	// one, or if it can't tell.
+	inline std::vector<unsigned> numa_nodes()
+	{
+		std::vector<unsigned> nodes;
+#if defined(__linux__)
+		nodes = detail::read_id_list("/sys/devices/system/node/online");
+#endif
+		if (nodes.empty()) nodes.push_back(0);
+		return nodes;
+	}
+
+	// Options for a pool of the given number of workers, spread evenly over
+	// the NUMA nodes, with each worker pinned to its node.
+	inline std::vector<thread_options> numa_worker_options(size_t threads)
+	{
+		std::vector<unsigned> nodes = numa_nodes();
+		std::vector<thread_options> options(threads);
+		for (size_t i = 0; i < threads; ++i)
+			options[i].numa_node = int(nodes[i * nodes.size() / threads]);
+		return options;
+	}
+
+	// -------------------------------------------------------------------------
+	// dispatch_thread: runs a dispatch_queue in a single background thread.
+	//
+	// Call dispatch() to execute a block in the background.
+	// Call stop() to stop accepting new blocks.
+	//
+	// The destructor calls stop() then waits for outstanding blocks to finish.
+	//
+	// basic_dispatch_thread can run any queue type with the same interface as
+	// dispatch_queue. For example, ring_dispatch_thread uses the lock-free
+	// ring_dispatch_queue. Any constructor arguments are passed to the queue,
+	// except for a thread_options, which may come first.
+
+	template <typename Queue> class basic_dispatch_thread
+	{
+		Queue _queue;
+		detail::os_thread _thread;
+
+	public:
+		template <
+			typename... Args,
+			typename = typename std::enable_if<
+				!detail::starts_with_thread_options<Args...>::value>::type>
+		explicit basic_dispatch_thread(Args&&... args)
+			: _queue(std::forward<Args>(args)...)
+		{
+			_thread.start(thread_options(), [this] { _queue.run_forever(); });
+		}
+
+		template <typename... Args>
+		explicit basic_dispatch_thread(
+			const thread_options& options, Args&&... args)
+			: _queue(std::forward<Args>(args)...)
+		{
+			_thread.start(options, [this] { _queue.run_forever(); });
+		}
+
+		basic_dispatch_thread(const basic_dispatch_thread&) = delete;
+		basic_dispatch_thread& operator=(const basic_dispatch_thread&) = delete;
+
+		// Get this thread's dispatch queue.
+		Queue& queue() { return _queue; }
+
+		// Post a lambda expression for execution on the background thread.
+		// Returns true on success, false if the queue is stopped.
+		template <typename F> bool dispatch(F&& function)
+		{
+			return _queue.dispatch(std::forward<F>(function));
+		}
+
+		// Make an awaitable that resumes a coroutine on the background
+		// thread, as in co_await thread.schedule(). Needs
+		// more_dispatch/coroutine.h.
+		template <typename Self = basic_dispatch_thread>
+		detail::schedule_awaitable<Self> schedule()
+		{
+			return detail::schedule_awaitable<Self>(*this);
+		}
+
+		// Post a block with the given qos class, if the queue supports it.
+		template <typename F> bool dispatch(qos level, F&& function)
+		{
+			return _queue.dispatch(level, std::forward<F>(function));
+		}
+
+		// Post a block if there's room, if the queue is bounded. See
+		// dispatch_queue::try_dispatch() and dispatch_for().
+		template <typename F> bool try_dispatch(F&& function)
+		{
+			return _queue.try_dispatch(std::forward<F>(function));
+		}
+
+		template <typename Timeout, typename F>
+		bool dispatch_for(Timeout timeout, F&& function)
+		{
+			return _queue.dispatch_for(timeout, std::forward<F>(function));
+		}
+
+		// Post many blocks at once. See dispatch_queue::dispatch_bulk().
+		template <typename It> bool dispatch_bulk(It begin, It end)
+		{
+			return _queue.dispatch_bulk(begin, end);
+		}
+
+		bool dispatch_bulk(dispatch_batch& batch)
+		{
+			return _queue.dispatch_bulk(batch);
+		}
+
+		// Post a block to run later, if the queue supports timers. See
+		// dispatch_queue::dispatch_after() and dispatch_every().
+		template <typename When, typename F>
+		dispatch_timer dispatch_after(When when, F&& function)
+		{
+			return _queue.dispatch_after(when, std::forward<F>(function));
+		}
+
+		template <typename Interval, typename F>
+		dispatch_timer dispatch_every(Interval interval, F&& function)
+		{
+			return _queue.dispatch_every(interval, std::forward<F>(function));
+		}
+
+		// Cache submissions, if the queue supports it. See
+		// dispatch_queue::cache_submissions() and flush().
+		void cache_submissions(size_t threshold)
+		{
+			_queue.cache_submissions(threshold);
+		}
+
+		void flush() { _queue.flush(); }
+
+		// Stop accepting new blocks. dispatch() will now return false.
+		// This method is idempotent; it's safe to call it multiple times.
+		void stop() { _queue.stop(); }
+
+		// Destructor. Stops the queue and waits for outstanding blocks to run.
+		~basic_dispatch_thread()
+		{
+			_queue.stop();
+			_queue.wait_until_done();
+			_thread.join();
+		}
+	};
+
+	typedef basic_dispatch_thread<dispatch_queue> dispatch_thread;
+	typedef basic_dispatch_thread<ring_dispatch_queue> ring_dispatch_thread;
+
+	// -------------------------------------------------------------------------
+	// dispatch_after: runs a block on a queue or thread once a deadline (a
+	// steady_clock time point) or a delay has passed.
+	// dispatch_every: runs a block repeatedly, at a fixed interval.
+	//
+	// Both return a dispatch_timer, which can cancel the block.
+
+	template <typename Queue, typename When, typename F>
+	dispatch_timer dispatch_after(Queue& queue, When when, F&& f)
+	{
+		return queue.dispatch_after(when, std::forward<F>(f));
+	}
+
+	template <typename Queue, typename Interval, typename F>
+	dispatch_timer dispatch_every(Queue& queue, Interval interval, F&& f)
+	{
+		return queue.dispatch_every(interval, std::forward<F>(f));
+	}
+
+	namespace detail
+	{
+		// Set the OS scheduling priority of the current thread to match a qos
+		// class. Returns false if that's not supported, or not permitted.
+		// (For example, on Linux raising priority needs CAP_SYS_NICE.)
+		inline bool set_thread_qos(qos level)
+		{
+#if defined(_WIN32)
+			static const int priorities[qos_count] = {
+				THREAD_PRIORITY_HIGHEST,
+				THREAD_PRIORITY_NORMAL,
+				THREAD_PRIORITY_LOWEST,
+			};
+			HANDLE thread = GetCurrentThread();
+			return SetThreadPriority(thread, priorities[size_t(level)]) != 0;
+#elif defined(__APPLE__)
+			static const qos_class_t classes[qos_count] = {
+				QOS_CLASS_USER_INTERACTIVE,
+				QOS_CLASS_DEFAULT,
+				QOS_CLASS_BACKGROUND,
+			};
+			return pthread_set_qos_class_self_np(classes[size_t(level)], 0)
+				== 0;
+#elif defined(__linux__)
+			static const int nice_values[qos_count] = { -5, 0, 10 };
+			pid_t tid = pid_t(syscall(SYS_gettid));
+			int nice_value = nice_values[size_t(level)];
+			return setpriority(PRIO_PROCESS, id_t(tid), nice_value) == 0;
+#else
+			return level == qos::normal;
+#endif
+		}
+	} // namespace detail
+
+	// -------------------------------------------------------------------------
+	// dispatch_pool: runs blocks concurrently on a pool of background threads.
+	// This is the equivalent of a GCD "concurrent queue".
+	//
+	// Call dispatch() to execute a block on any of the pool's threads.
+	// Call stop() to stop accepting new blocks.
+	//
+	// Each worker thread has its own local deque. Blocks dispatched from one
+	// of the pool's own threads go to that thread's deque; blocks dispatched
+	// from anywhere else are spread round-robin over the workers. Idle workers
+	// steal blocks from busy workers, so the load balances itself.
+	//
+	// Unlike dispatch_thread, blocks may run in parallel and in any order.
+	//
+	// A pool can be given a qos class, which sets the OS priority of its
+	// threads. Use separate pools for work of different priorities.
+	//
+	// A pool can also be given a thread_options for each worker. Idle workers
+	// try to steal from workers on their own NUMA node before they try the
+	// rest; numa_worker_options() makes options to spread the workers over
+	// every node.
+	//
+	// The destructor calls stop() then waits for outstanding blocks to finish.
+
+	class fork_join;
+
+	class dispatch_pool
+	{
+		friend class fork_join;
+
+		struct worker
+		{
+			std::mutex _mutex;
+			std::deque<dispatch_block> _deque;
+			detail::os_thread _thread;
+
+			// The workers to look for blocks in, starting with this one,
+			// then the others on the same NUMA node.
+			std::vector<size_t> _steal_order;
+		};
+
+		block_arena _arena; // Must outlive the workers.
+		std::vector<std::unique_ptr<worker>> _workers;
+		std::mutex _mutex;
+		std::condition_variable _cond;
+		std::atomic<bool> _done;
+		std::atomic<size_t> _pending; // Blocks queued but not yet started.
+		std::atomic<size_t> _sleeping; // Workers waiting on _cond.
+		std::atomic<size_t> _next; // Round-robin counter for outside threads.
+		detail::discard_count _discarding;
+		qos _qos;
+
+		struct current_worker
+		{
+			dispatch_pool* pool;
+			size_t index;
+		};
+
+		static current_worker& current()
+		{
+			static thread_local current_worker c = { nullptr, 0 };
+			return c;
+		}
+
+		// Add a block to a worker's deque. If the pool is stopped, the block
+		// is destroyed, or run on the calling thread if run_if_stopped is set.
+		bool _dispatch(dispatch_block&& block, bool run_if_stopped = false)
+		{
+			const current_worker& c = current();
+			size_t index = c.index;
+			if (c.pool != this) {
+				index = _next.fetch_add(1, std::memory_order_relaxed);
+				index %= _workers.size();
+			}
+			worker& w = *_workers[index];
+			{
+				std::lock_guard<std::mutex> lock(w._mutex);
+				if (!_done.load(std::memory_order_relaxed)) {
+					w._deque.push_back(std::move(block));
+					_pending.fetch_add(1);
+
+					// Wake a worker while we still hold the lock. That way
+					// stop() can't finish, and nor can the destructor, until
+					// we're done.
+					if (_sleeping.load() > 0) {
+						std::lock_guard<std::mutex> lock(_mutex);
+						_cond.notify_one();
+					}
+					return true;
+				}
+
+				// Refused. See detail::discard_count.
+				_discarding.enter();
+			}
+			if (run_if_stopped) block.invoke_and_destroy();
+			else block.reset();
+			_discarding.leave();
+			return false;
+		}
+
+		// Take the block at the front of a worker's deque (or the back, for
+		// the newest), if it has one, and run it on this thread.
+		bool _run_from(worker& w, bool newest = false)
+		{
+			dispatch_block block;
+			{
+				std::lock_guard<std::mutex> lock(w._mutex);
+				if (w._deque.empty()) return false;
+				if (newest) {
+					block = std::move(w._deque.back());
+					w._deque.pop_back();
+				} else {
+					block = std::move(w._deque.front());
+					w._deque.pop_front();
+				}
+				_pending.fetch_sub(1);
+			}
+			block.invoke_and_destroy();
+			detail::submission_cache::flush_current();
+			return true;
+		}
+
+		// Run one block, from our own deque if possible, otherwise stolen
+		// from another worker. Returns false if no blocks were found.
+		bool _run_one(size_t index)
+		{
+			for (size_t victim : _workers[index]->_steal_order) {
+				if (_run_from(*_workers[victim])) return true;
+			}
+			return false;
+		}
+
+		void _run_worker(size_t index)
+		{
+			current_worker& c = current();
+			c.pool = this;
+			c.index = index;
+			if (_qos != qos::normal) detail::set_thread_qos(_qos);
+
+			while (true) {
+				if (_run_one(index)) continue;
+
+				std::unique_lock<std::mutex> lock(_mutex);
+				_sleeping.fetch_add(1);
+				while (_pending.load() == 0 && !_done.load())
+					_cond.wait(lock);
+				_sleeping.fetch_sub(1);
+				if (_pending.load() == 0 && _done.load()) return;
+			}
+		}
+
+	public:
+		// Start a pool with the given number of worker threads. By default,
+		// this is the number of hardware threads.
+		explicit dispatch_pool(
+			size_t threads = std::thread::hardware_concurrency(),
+			qos level = qos::normal)
+			: dispatch_pool(
+				std::vector<thread_options>(std::max<size_t>(threads, 1)),
+				level)
+		{
+		}
+
+		// Start a pool with a worker thread for each thread_options.
+		explicit dispatch_pool(
+			const std::vector<thread_options>& workers,
+			qos level = qos::normal)
+			: _done(false)
+			, _pending(0)
+			, _sleeping(0)
+			, _next(0)
+			, _qos(level)
+		{
+			size_t threads = std::max<size_t>(workers.size(), 1);
+			for (size_t i = 0; i < threads; ++i)
+				_workers.emplace_back(new worker);
+
+			// Steal from the same node first, then from the others, each
+			// in turn starting after this worker so they don't all pick on
+			// the same victim.
+			std::vector<int> nodes(threads, -1);
+			for (size_t i = 0; i < workers.size(); ++i)
+				nodes[i] = workers[i].numa_node;
+			for (size_t i = 0; i < threads; ++i) {
+				std::vector<size_t>& order = _workers[i]->_steal_order;
+				std::vector<size_t> remote;
+				for (size_t j = 0; j < threads; ++j) {
+					size_t victim = (i + j) % threads;
+					if (nodes[victim] == nodes[i]) order.push_back(victim);
+					else remote.push_back(victim);
+				}
+				order.insert(order.end(), remote.begin(), remote.end());
+			}
+
+			for (size_t i = 0; i < threads; ++i) {
+				_workers[i]->_thread.start(
+					i < workers.size() ? workers[i] : thread_options(),
+					[this, i] { _run_worker(i); });
+			}
+		}
+
+		dispatch_pool(const dispatch_pool&) = delete;
+		dispatch_pool& operator=(const dispatch_pool&) = delete;
+
+		// The number of worker threads.
+		size_t thread_count() const { return _workers.size(); }
+
+		// How much of the pool's block_arena is in use.
+		arena_stats arena_usage() const { return _arena.stats(); }
+
+		// Run one waiting block on the calling thread, if there is one.
+		// Returns false if there wasn't. On one of the pool's own threads,
+		// this takes the newest block from the thread's own deque, or else
+		// steals one, so a block that waits for work it dispatched can help
+		// with it instead of blocking. (That's what fork_join does.)
+		bool run_one()
+		{
+			const current_worker& c = current();
+			if (c.pool == this) {
+				return _run_from(*_workers[c.index], true)
+					|| _run_one(c.index);
+			}
+			size_t start = _next.fetch_add(1, std::memory_order_relaxed);
+			for (size_t i = 0; i < _workers.size(); ++i) {
+				if (_run_from(*_workers[(start + i) % _workers.size()]))
+					return true;
+			}
+			return false;
+		}
+
+		// Post a lambda expression for execution on one of the pool's threads.
+		// Returns true on success, false if the pool is stopped.
+		template <typename F> bool dispatch(F&& lambda)
+		{
+			return _dispatch(dispatch_block(std::forward<F>(lambda), _arena));
+		}
+
+		// Make an awaitable that resumes a coroutine on one of the pool's
+		// threads, as in co_await pool.schedule(). Needs
+		// more_dispatch/coroutine.h.
+		template <typename Self = dispatch_pool>
+		detail::schedule_awaitable<Self> schedule()
+		{
+			return detail::schedule_awaitable<Self>(*this);
+		}
+
+		// Stop accepting new blocks. dispatch() will now return false.
+		// This method is idempotent; it's safe to call it multiple times.
+		void stop()
+		{
+			// Take every worker's lock, so no dispatch() can be half-way
+			// through adding a block when we set _done.
+			std::vector<std::unique_lock<std::mutex>> locks;
+			for (auto& w : _workers)
+				locks.emplace_back(w->_mutex);
+			_done.store(true);
+			locks.clear();
+
+			std::lock_guard<std::mutex> lock(_mutex);
+			_cond.notify_all();
+		}
+
+		// Destructor. Stops the pool and waits for outstanding blocks to run.
+		~dispatch_pool()
+		{
+			stop();
+			for (auto& w : _workers) {
+				w->_thread.join();
+
+				// Wait out any dispatch() that's still refusing a block.
+				std::lock_guard<std::mutex> lock(w->_mutex);
+			}
+			_discarding.wait();
+		}
+	};
+
+	// -------------------------------------------------------------------------
+	// serial_queue: runs blocks one at a time, in FIFO order, on a pool.
+	// This is the equivalent of a GCD serial queue with a target queue.
+	//
+	// A serial_queue has no thread of its own. When blocks arrive, it posts a
+	// single drain block to its pool, which runs whatever has been queued
+	// with dispatch_queue::run_once() and then gives the worker back, posting
+	// itself again if more blocks have arrived. So thousands of mostly idle
+	// serial queues can share a handful of threads, and a busy one can't hog
+	// a worker while others are waiting.
+	//
+	// Blocks on one serial queue never run concurrently with each other, but
+	// may run on a different pool thread each time.
+	//
+	// The pool must outlive the serial queue. If the pool has been stopped,
+	// blocks run on the thread that dispatches them instead.
+	//
+	// The destructor calls stop() then waits for outstanding blocks to run.
+
+	class serial_queue
+	{
+		dispatch_pool& _pool;
+		dispatch_queue _queue;
+		std::atomic<bool> _scheduled; // Whether a drain is posted or running.
+		std::atomic<size_t> _draining; // Drains that may still touch *this.
+
+		// Post a drain to the pool, unless there's one already.
+		void _schedule()
+		{
+			if (_scheduled.exchange(true)) return;
+			_draining.fetch_add(1, std::memory_order_relaxed);
+			if (!_pool.dispatch([this] { _drain(); })) _drain();
+		}
+
+		void _drain()
+		{
+			while (true) {
+				_queue.run_once();
+
+				// Producers add their block and then check _scheduled, while
+				// we clear _scheduled and then check for blocks. So either
+				// they see that there's no drain, or we see their block.
+				_scheduled.store(false);
+				if (_queue.empty() || _scheduled.exchange(true)) break;
+
+				// More blocks have arrived. Go to the back of the pool's
+				// queue, so other serial queues get a turn. The new drain
+				// inherits our place in _draining.
+				if (_pool.dispatch([this] { _drain(); })) return;
+			}
+			_draining.fetch_sub(1, std::memory_order_release);
+		}
+
+	public:
+		explicit serial_queue(dispatch_pool& pool)
+			: _pool(pool)
+			, _scheduled(false)
+			, _draining(0)
+		{
+		}
+
+		serial_queue(const serial_queue&) = delete;
+		serial_queue& operator=(const serial_queue&) = delete;
+
+		// Queue a lambda expression or functor for execution.
+		// Returns true on success, false if the queue is stopped.
+		template <typename F> bool dispatch(F&& lambda)
+		{
+			return dispatch(qos::normal, std::forward<F>(lambda));
+		}
+
+		// Make an awaitable that resumes a coroutine on this queue, as in
+		// co_await queue.schedule(). Needs more_dispatch/coroutine.h.
+		template <typename Self = serial_queue>
+		detail::schedule_awaitable<Self> schedule()
+		{
+			return detail::schedule_awaitable<Self>(*this);
+		}
+
+		// Queue a block with the given qos class. This orders blocks within
+		// this queue; it doesn't change the priority of the pool's threads.
+		template <typename F> bool dispatch(qos level, F&& lambda)
+		{
+			if (!_queue.dispatch(level, std::forward<F>(lambda))) return false;
+			_schedule();
+			return true;
+		}
+
+		// Queue many blocks at once. See dispatch_queue::dispatch_bulk().
+		template <typename It> bool dispatch_bulk(It begin, It end)
+		{
+			if (!_queue.dispatch_bulk(begin, end)) return false;
+			_schedule();
+			return true;
+		}
+
+		bool dispatch_bulk(dispatch_batch& batch)
+		{
+			if (!_queue.dispatch_bulk(batch)) return false;
+			_schedule();
+			return true;
+		}
+
+		// Stop accepting new blocks. dispatch() will now return false.
+		// This method is idempotent; it's safe to call it multiple times.
+		void stop() { _queue.stop(); }
+
+		// Wait until the queue is stopped and all outstanding blocks have run.
+		void wait_until_done() { _queue.wait_until_done(); }
+
+		// Destructor. Stops the queue and waits for outstanding blocks to run.
+		~serial_queue()
+		{
+			_queue.stop();
+			_queue.wait_until_done();
+			while (_draining.load(std::memory_order_acquire) > 0)
+				std::this_thread::yield();
+		}
+	};
+
+	// -------------------------------------------------------------------------
+	// dispatch_apply: runs f(i) for every i in [0, n), in parallel on a pool.
+	//
+	// The range is split into chunks, with a few chunks per worker so that
+	// the load balances well, and the calling thread runs chunks too. Returns
+	// once every iteration has finished.
+	//
+	// If f throws, the remaining iterations are skipped, and once every
+	// chunk that had started has finished, dispatch_apply() rethrows the
+	// first exception on the calling thread.
+	//
+	// It's safe to call this from a block running on the same pool. The
+	// caller never waits for a chunk that hasn't started, so if the pool is
+	// busy, the caller just ends up doing all the work itself.
+
+	namespace detail
+	{
+		template <typename F> struct apply_state
+		{
+			F* function;
+			size_t n;
+			size_t grain;
+			size_t chunks;
+			std::atomic<size_t> next; // Next chunk to be claimed.
+			std::atomic<size_t> done; // Number of chunks finished.
+			std::atomic<bool> failed;
+			std::exception_ptr error; // The first exception, once failed.
+			std::mutex mutex;
+			std::condition_variable cond;
+
+			// Claim and run chunks until there are none left. Once one has
+			// thrown, the rest are claimed but skipped, so that they still
+			// count as done.
+			void run()
+			{
+				size_t finished = 0;
+				while (true) {
+					size_t chunk = next.fetch_add(1, std::memory_order_relaxed);
+					if (chunk >= chunks) break;
+					size_t end = std::min(n, (chunk + 1) * grain);
+					try {
+						for (size_t i = chunk * grain;
+							 i < end && !failed.load(std::memory_order_relaxed);
+							 ++i)
+							(*function)(i);
+					} catch (...) {
+						std::lock_guard<std::mutex> lock(mutex);
+						if (!failed.exchange(true))
+							error = std::current_exception();
+					}
+					++finished;
+				}
+				if (finished && done.fetch_add(finished) + finished == chunks) {
+					std::lock_guard<std::mutex> lock(mutex);
+					cond.notify_all();
+				}
+			}
+		};
+	} // namespace detail
+
+	template <typename F>
+	void dispatch_apply(dispatch_pool& pool, size_t n, F&& f)
+	{
+		typedef typename std::remove_reference<F>::type function_type;
+		typedef detail::apply_state<function_type> state_type;
+		if (n == 0) return;
+
+		const size_t chunks_per_thread = 4;
+		size_t threads = pool.thread_count() + 1;
+		size_t chunks = std::min(n, threads * chunks_per_thread);
+
+		std::shared_ptr<state_type> state = std::make_shared<state_type>();
+		state->function = &f;
+		state->n = n;
+		state->grain = (n + chunks - 1) / chunks;
+		state->chunks = (n + state->grain - 1) / state->grain;
+		state->next.store(0, std::memory_order_relaxed);
+		state->done.store(0, std::memory_order_relaxed);
+		state->failed.store(false, std::memory_order_relaxed);
+
+		size_t helpers = std::min(pool.thread_count(), state->chunks - 1);
+		for (size_t i = 0; i < helpers; ++i) {
+			if (!pool.dispatch([state] { state->run(); })) break;
+		}
+
+		state->run();
+
+		std::unique_lock<std::mutex> lock(state->mutex);
+		while (state->done.load() < state->chunks)
+			state->cond.wait(lock);
+
+		// Take the exception out of the state, which a helper block might be
+		// the last to let go of.
+		std::exception_ptr error = std::move(state->error);
+		lock.unlock();
+		if (error) std::rethrow_exception(error);
+	}
+	// -------------------------------------------------------------------------
+	// future: the result of a block run with dispatch_async().
+	//
+	// dispatch_async(queue, f) queues f on any dispatch queue, thread or pool,
+	// and returns a future for its result. Then you can either:
+	//
+	// - Call get() to wait for the result.
+	// - Call then(queue, g) to run g(result) on another queue once it's ready.
+	//   That returns another future, so continuations can be chained.
+	//
+	// The state shared between the block and the future comes from a slab
+	// pool rather than the heap, so dispatch_async() doesn't allocate unless
+	// the block itself is too big to fit inline.
+	//
+	// If the queue is stopped, dispatch_async() returns an invalid future. If
+	// a block is destroyed without running, its future becomes "broken":
+	// it's ready, but has no value, and any continuations don't run. Calling
+	// get() on it throws std::future_error.
+
+	namespace detail
+	{
+		template <typename T> struct future_value
+		{
+			typename std::aligned_storage<sizeof(T), alignof(T)>::type _storage;
+			bool _has_value = false;
+
+			T* get() { return reinterpret_cast<T*>(&_storage); }
+
+			template <typename F> void set_from(F& f)
+			{
+				new (&_storage) T(f());
+				_has_value = true;
+			}
+
+			T take()
+			{
+				assert(_has_value);
+				T result(std::move(*get()));
+				get()->~T();
+				_has_value = false;
+				return result;
+			}
+
+			~future_value()
+			{
+				if (_has_value) get()->~T();
+			}
+		};
+
+		template <> struct future_value<void>
+		{
+			template <typename F> void set_from(F& f) { f(); }
+			void take() {}
+		};
+
+		enum
+		{
+			future_ready = 1,
+			future_broken = 2,
+			future_waiting = 4,
+			future_continued = 8,
+		};
+
+		template <typename T>
+		struct future_state : public pooled<future_state<T>>
+		{
+			std::atomic<int> _refs;
+			std::atomic<int> _flags;
+			future_value<T> _value;
+			dispatch_block _continuation;
+			std::mutex _mutex;
+			std::condition_variable _cond;
+
+			// One reference for the promise, one for the future.
+			future_state() : _refs(2), _flags(0) {}
+
+			void release()
+			{
+				if (_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+					delete this;
+			}
+
+			// Mark the state as ready, and wake anyone waiting for it.
+			void complete(int flags)
+			{
+				int old = _flags.fetch_or(future_ready | flags);
+				if (old & future_continued) _run_continuation();
+				if (old & future_waiting) {
+					std::lock_guard<std::mutex> lock(_mutex);
+					_cond.notify_all();
+				}
+			}
+
+			// Run the given block when the state is ready, or right away if
+			// it's ready already.
+			template <typename F> void set_continuation(F&& f)
+			{
+				_continuation = dispatch_block(std::forward<F>(f));
+				int old = _flags.fetch_or(future_continued);
+				if (old & future_ready) _run_continuation();
+			}
+
+			void wait()
+			{
+				if (_flags.load() & future_ready) return;
+				std::unique_lock<std::mutex> lock(_mutex);
+				if (_flags.fetch_or(future_waiting) & future_ready) return;
+				while (!(_flags.load() & future_ready))
+					_cond.wait(lock);
+			}
+
+			bool broken() const { return _flags.load() & future_broken; }
+
+		private:
+			void _run_continuation() { _continuation.invoke_and_destroy(); }
+		};
+
+		// The producer's end of a future_state. If it's destroyed without
+		// calling run(), the future is broken.
+		template <typename T> class promise
+		{
+			future_state<T>* _state;
+
+		public:
+			explicit promise(future_state<T>* state) : _state(state) {}
+			promise(promise&& other) : _state(other._state)
+			{
+				other._state = nullptr;
+			}
+
+			// Call f() and store its result.
+			template <typename F> void run(F& f)
+			{
+				_state->_value.set_from(f);
+				_state->complete(0);
+				_state->release();
+				_state = nullptr;
+			}
+
+			~promise()
+			{
+				if (!_state) return;
+				_state->complete(future_broken);
+				_state->release();
+			}
+		};
+
+		// Calls g with the value of a ready future_state.
+		template <typename T, typename G> struct future_apply
+		{
+			G& g;
+			future_state<T>& state;
+
+			auto operator()() -> decltype(g(state._value.take()))
+			{
+				return g(state._value.take());
+			}
+		};
+
+		template <typename G> struct future_apply<void, G>
+		{
+			G& g;
+			future_state<void>& state;
+
+			auto operator()() -> decltype(g()) { return g(); }
+		};
+
+		template <typename T, typename F> struct async_task
+		{
+			promise<T> _promise;
+			F _function;
+
+			void operator()() { _promise.run(_function); }
+		};
+	} // namespace detail
+
+	template <typename T> class future
+	{
+		template <typename U> friend class future;
+
+		detail::future_state<T>* _state;
+
+		template <typename G> using apply = detail::future_apply<T, G>;
+
+		// Runs a continuation on its queue.
+		template <typename U, typename G> struct task
+		{
+			future _source;
+			detail::promise<U> _promise;
+			G _function;
+
+			void operator()()
+			{
+				apply<G> a = { _function, *_source._state };
+				_promise.run(a);
+			}
+		};
+
+		// Sends a continuation to its queue, unless the source is broken.
+		template <typename Queue, typename Task> struct send
+		{
+			Queue* _queue;
+			Task _task;
+
+			void operator()()
+			{
+				if (!_task._source._state->broken())
+					_queue->dispatch(std::move(_task));
+			}
+		};
+
+	public:
+		future() : _state(nullptr) {}
+		explicit future(detail::future_state<T>* state) : _state(state) {}
+
+		future(future&& other) : _state(other._state)
+		{
+			other._state = nullptr;
+		}
+
+		future& operator=(future&& other)
+		{
+			std::swap(_state, other._state);
+			return *this;
+		}
+
+		future(const future&) = delete;
+		future& operator=(const future&) = delete;
+
+		~future()
+		{
+			if (_state) _state->release();
+		}
+
+		// Whether this future refers to a block (which may not have run yet).
+		bool valid() const { return _state != nullptr; }
+
+		// Whether the block has finished (or has been destroyed unrun).
+		bool ready() const
+		{
+			assert(valid());
+			return _state->_flags.load() & detail::future_ready;
+		}
+
+		// Whether the block was destroyed without running.
+		bool broken() const { return ready() && _state->broken(); }
+
+		// Wait for the block to finish.
+		void wait() const
+		{
+			assert(valid());
+			_state->wait();
+		}
+
+		// Wait for the block to finish, and return its result. Afterwards,
+		// the future is no longer valid. Throws std::future_error if the
+		// future isn't valid, or is broken.
+		T get()
+		{
+			if (!valid()) throw std::future_error(std::future_errc::no_state);
+			future f(std::move(*this));
+			f.wait();
+			if (f.broken())
+				throw std::future_error(std::future_errc::broken_promise);
+			return f._state->_value.take();
+		}
+
+		// When the block finishes, pass its result to g, on the given queue.
+		// Returns a future for the result of g. This future is no longer
+		// valid afterwards.
+		template <
+			typename Queue,
+			typename G,
+			typename Gn = typename std::decay<G>::type,
+			typename U = decltype(std::declval<apply<Gn>>()())>
+		future<U> then(Queue& queue, G&& g)
+		{
+			if (!valid()) return future<U>();
+			detail::future_state<T>* state = _state;
+			detail::future_state<U>* next = new detail::future_state<U>;
+
+			typedef task<U, Gn> task_type;
+			send<Queue, task_type> s = { &queue,
+										 task_type{ std::move(*this),
+													detail::promise<U>(next),
+													std::forward<G>(g) } };
+			state->set_continuation(std::move(s));
+			return future<U>(next);
+		}
+	};
+
+	template <
+		typename Queue,
+		typename F,
+		typename Fn = typename std::decay<F>::type,
+		typename T = decltype(std::declval<Fn&>()())>
+	future<T> dispatch_async(Queue& queue, F&& f)
+	{
+		detail::future_state<T>* state = new detail::future_state<T>;
+		future<T> result(state);
+		detail::async_task<T, Fn> task = { detail::promise<T>(state),
+										   std::forward<F>(f) };
+		if (!queue.dispatch(std::move(task))) return future<T>();
+		return result;
+	}
+	// -------------------------------------------------------------------------
+	// dispatch_group: tracks a set of blocks, so you can wait for them all.
+	//
+	// Call dispatch(queue, block) to run a block on any queue, thread or pool
+	// as part of the group. (Or call enter() and leave() to track work that
+	// isn't a single block.)
+	// Call wait() to wait until there's no outstanding work in the group.
+	// Call notify(queue, block) to run a block once the group is empty.
+	//
+	// Call cancel() to skip every block in the group that hasn't started
+	// yet, including those dispatched to it later. A group made with a
+	// parent group (or token) is cancelled along with its parent, so one
+	// cancel() revokes a whole subtree of work. A cancelled block still
+	// counts as finished, so wait() and notify() work as usual.
+	//
+	// The group only uses an atomic counter while blocks come and go. The
+	// mutex is only taken when the group becomes empty, or to wait on it.
+	// A group can be reused once it's empty, unless it has been cancelled;
+	// it stays cancelled.
+
+	class dispatch_group
+	{
+		std::atomic<size_t> _count;
+		std::mutex _mutex;
+		std::condition_variable _cond;
+		std::vector<dispatch_block> _notify;
+		cancellation_token _token;
+
+		// A block in the group. If it's destroyed without having run,
+		// because its queue dropped or refused it, it still leaves the
+		// group, much as a promise breaks its future.
+		template <typename F> struct task
+		{
+			dispatch_group* _group; // Null once it has left.
+			F _function;
+
+			template <typename G>
+			task(dispatch_group* group, G&& function)
+				: _group(group)
+				, _function(std::forward<G>(function))
+			{
+			}
+
+			task(task&& other)
+				: _group(other._group)
+				, _function(std::move(other._function))
+			{
+				other._group = nullptr;
+			}
+
+			~task()
+			{
+				if (_group) _group->leave();
+			}
+
+			void operator()()
+			{
+				if (!_group->_token.cancelled()) _function();
+				dispatch_group* group = _group;
+				_group = nullptr;
+				group->leave();
+			}
+		};
+
+		template <typename Queue, typename F> struct notify_task
+		{
+			Queue* _queue;
+			F _function;
+
+			void operator()() { _queue->dispatch(std::move(_function)); }
+		};
+
+	public:
+		dispatch_group() : _count(0) {}
+
+		// Make a group that's cancelled when the parent group is.
+		explicit dispatch_group(dispatch_group& parent)
+			: _count(0)
+			, _token(parent._token.child())
+		{
+		}
+
+		// Make a group that's cancelled when the token is.
+		explicit dispatch_group(const cancellation_token& parent)
+			: _count(0)
+			, _token(parent.child())
+		{
+		}
+
+		dispatch_group(const dispatch_group&) = delete;
+		dispatch_group& operator=(const dispatch_group&) = delete;
+
+		// Add a block to the group, and dispatch it to the given queue.
+		// Returns true on success, false if the queue is stopped.
+		template <typename Queue, typename F>
+		bool dispatch(Queue& queue, F&& function)
+		{
+			typedef task<typename std::decay<F>::type> task_type;
+			enter();
+			return queue.dispatch(task_type(this, std::forward<F>(function)));
+		}
+
+		// Manually mark some work as having started.
+		void enter() { _count.fetch_add(1, std::memory_order_relaxed); }
+
+		// Manually mark some work as having finished.
+		void leave()
+		{
+			// The common case just decrements the count. Only the final
+			// leave() takes the lock, so that nobody can see the group empty
+			// (and perhaps destroy it) until we're done with it.
+			size_t count = _count.load(std::memory_order_relaxed);
+			while (count > 1) {
+				if (_count.compare_exchange_weak(
+						count, count - 1, std::memory_order_acq_rel))
+					return;
+			}
+
+			std::vector<dispatch_block> notify;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				size_t old = _count.fetch_sub(1, std::memory_order_acq_rel);
+				assert(old > 0);
+				if (old != 1) return;
+				std::swap(notify, _notify);
+				_cond.notify_all();
+			}
+			for (auto& block : notify)
+				block.invoke_and_destroy();
+		}
+
+		// Skip every block in the group, and in its child groups, that
+		// hasn't started yet. Returns true if it wasn't already cancelled.
+		bool cancel() { return _token.cancel(); }
+
+		// Whether the group, or a parent, has been cancelled. Long-running
+		// blocks in the group can check this to stop early.
+		bool cancelled() const { return _token.cancelled(); }
+
+		// The group's token, for dispatching blocks (or making groups) that
+		// should be cancelled along with it.
+		const cancellation_token& token() const { return _token; }
+
+		// Whether the group has no outstanding work.
+		bool empty() const
+		{
+			return _count.load(std::memory_order_acquire) == 0;
+		}
+
+		// Wait until the group has no outstanding work.
+		void wait()
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			while (!empty())
+				_cond.wait(lock);
+		}
+
+		// Wait until the group is empty, or the timeout expires.
+		// Returns true if the group is empty.
+		template <typename Rep, typename Period>
+		bool wait_for(const std::chrono::duration<Rep, Period>& timeout)
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			return _cond.wait_for(lock, timeout, [this] { return empty(); });
+		}
+
+		// Dispatch a block to the given queue once the group is empty (or
+		// right away, if it's empty already).
+		template <typename Queue, typename F>
+		void notify(Queue& queue, F&& function)
+		{
+			typedef notify_task<Queue, typename std::decay<F>::type> task_type;
+			task_type t = { &queue, std::forward<F>(function) };
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				if (!empty()) {
+					_notify.emplace_back(std::move(t));
+					return;
+				}
+			}
+			t();
+		}
+
+		// Destructor. Waits for outstanding work to finish.
+		~dispatch_group() { wait(); }
+	};
+
+	// -------------------------------------------------------------------------
+	// fork_join: spawn blocks on a pool, then sync with them, for recursive
+	// divide-and-conquer.
+	//
+	// Call spawn() to run a block on the pool, and sync() to wait until every
+	// block spawned so far has finished. A sync() doesn't block its thread
+	// while there's work in the pool: it runs other blocks until its own have
+	// finished, starting with the newest in its own deque, which are usually
+	// the ones it has just spawned. So a block on the pool can spawn children
+	// and sync with them, to any depth, without tying up workers or
+	// deadlocking, even on a pool with one thread. (This is "help-first"
+	// scheduling: the children wait in the deque while the parent carries
+	// on, and anyone can steal them.)
+	//
+	// parallel_invoke(pool, f, g, ...) runs its functions in parallel and
+	// returns when they've all finished. parallel_reduce() and parallel_sort()
+	// are built on it.
+	//
+	// If the pool is stopped, spawn() runs the block right away. The
+	// destructor calls sync().
+
+	class fork_join
+	{
+		dispatch_pool& _pool;
+		dispatch_group _group;
+
+		// A spawned block. Like dispatch_group's, it leaves the group when
+		// it's destroyed, if it hasn't run.
+		template <typename F> struct task
+		{
+			dispatch_group* _group; // Null once it has left.
+			F _function;
+
+			template <typename G>
+			task(dispatch_group* group, G&& function)
+				: _group(group)
+				, _function(std::forward<G>(function))
+			{
+			}
+
+			task(task&& other)
+				: _group(other._group)
+				, _function(std::move(other._function))
+			{
+				other._group = nullptr;
+			}
+
+			~task()
+			{
+				if (_group) _group->leave();
+			}
+
+			void operator()()
+			{
+				_function();
+				dispatch_group* group = _group;
+				_group = nullptr;
+				group->leave();
+			}
+		};
+
+	public:
+		explicit fork_join(dispatch_pool& pool) : _pool(pool) {}
+
+		fork_join(const fork_join&) = delete;
+		fork_join& operator=(const fork_join&) = delete;
+
+		// Run a block on the pool, in parallel with the caller.
+		template <typename F> void spawn(F&& function)
+		{
+			typedef task<typename std::decay<F>::type> task_type;
+			_group.enter();
+			task_type t(&_group, std::forward<F>(function));
+			dispatch_block block(std::move(t), _pool._arena);
+			_pool._dispatch(std::move(block), true);
+		}
+
+		// Wait until every spawned block has finished, running blocks from
+		// the pool in the meantime.
+		void sync()
+		{
+			while (!_group.empty()) {
+				if (_pool.run_one()) continue;
+				_group.wait_for(std::chrono::microseconds(100));
+			}
+		}
+
+		~fork_join() { sync(); }
+	};
+
+	template <typename F> void parallel_invoke(dispatch_pool&, F&& f)
+	{
+		f();
+	}
+
+	// Run every function in parallel on the pool, and the first one on the
+	// calling thread. Returns when they have all finished.
+	template <typename F, typename... Fs>
+	void parallel_invoke(dispatch_pool& pool, F&& f, Fs&&... fs)
+	{
+		fork_join scope(pool);
+		int spawn[] = { (scope.spawn(std::forward<Fs>(fs)), 0)... };
+		(void)spawn;
+		f();
+		scope.sync();
+	}
+
+	namespace detail
+	{
+		// A default grain size for splitting n items between a pool's
+		// threads, with a few pieces each so that the load balances.
+		inline size_t parallel_grain(dispatch_pool& pool, size_t n)
+		{
+			return std::max<size_t>(1, n / (8 * (pool.thread_count() + 1)));
+		}
+
+		template <typename It, typename Op, typename T>
+		struct parallel_reducer
+		{
+			dispatch_pool& pool;
+			Op& op;
+			size_t grain;
+
+			// Reduce a non-empty range.
+			T operator()(It begin, It end)
+			{
+				if (size_t(end - begin) <= grain) {
+					T result = *begin;
+					for (++begin; begin != end; ++begin)
+						result = op(std::move(result), *begin);
+					return result;
+				}
+				It middle = begin + (end - begin) / 2;
+				future_value<T> left, right;
+				auto reduce_left = [&] { return (*this)(begin, middle); };
+				auto reduce_right = [&] { return (*this)(middle, end); };
+				parallel_invoke(
+					pool,
+					[&] { left.set_from(reduce_left); },
+					[&] { right.set_from(reduce_right); });
+				return op(left.take(), right.take());
+			}
+		};
+
+		template <typename It, typename Compare> struct parallel_sorter
+		{
+			typedef typename std::iterator_traits<It>::value_type value_type;
+
+			dispatch_pool& pool;
+			Compare& less;
+			size_t grain;
+
+			// A quicksort that sorts both sides of each partition in
+			// parallel. Like introsort, it falls back to std::sort for a
+			// range that has had too many bad pivots.
+			void operator()(It begin, It end, unsigned depth)
+			{
+				size_t n = size_t(end - begin);
+				if (n <= grain || depth == 0) {
+					std::sort(begin, end, less);
+					return;
+				}
+
+				// Median of three, then split into less than the pivot,
+				// equal to it, and greater.
+				It middle = begin + n / 2;
+				It last = end - 1;
+				if (less(*middle, *begin)) std::iter_swap(middle, begin);
+				if (less(*last, *middle)) std::iter_swap(last, middle);
+				if (less(*middle, *begin)) std::iter_swap(middle, begin);
+				value_type pivot = *middle;
+				It lower = std::partition(begin, end, [&](const value_type& x) {
+					return less(x, pivot);
+				});
+				It upper = std::partition(lower, end, [&](const value_type& x) {
+					return !less(pivot, x);
+				});
+				parallel_invoke(
+					pool,
+					[&] { (*this)(begin, lower, depth - 1); },
+					[&] { (*this)(upper, end, depth - 1); });
+			}
+		};
+	} // namespace detail
+
+	// Combine every element of [begin, end) with op, in parallel on the
+	// pool, starting from init. op must be associative, but needn't be
+	// commutative. The range is split in half recursively, down to pieces
+	// of grain elements (by default, a few per thread).
+	template <typename It, typename T, typename Op>
+	T parallel_reduce(
+		dispatch_pool& pool, It begin, It end, T init, Op op, size_t grain = 0)
+	{
+		if (begin == end) return init;
+		size_t n = size_t(end - begin);
+		if (grain == 0) grain = detail::parallel_grain(pool, n);
+		detail::parallel_reducer<It, Op, T> reduce = { pool, op, grain };
+		return op(std::move(init), reduce(begin, end));
+	}
+
+	// Sort [begin, end) in parallel on the pool. Not stable. Ranges of
+	// grain elements or fewer are sorted with std::sort.
+	template <typename It, typename Compare>
+	void parallel_sort(
+		dispatch_pool& pool, It begin, It end, Compare less, size_t grain = 0)
+	{
+		size_t n = size_t(end - begin);
+		if (grain == 0)
+			grain = std::max<size_t>(2048, detail::parallel_grain(pool, n));
+		unsigned depth = 0;
+		for (size_t i = n; i > 1; i >>= 1)
+			depth += 2;
+		detail::parallel_sorter<It, Compare> sort = { pool, less, grain };
+		sort(begin, end, depth);
+	}
+
+	template <typename It>
+	void parallel_sort(dispatch_pool& pool, It begin, It end)
+	{
+		typedef typename std::iterator_traits<It>::value_type value_type;
+		parallel_sort(pool, begin, end, std::less<value_type>());
+	}
+
+	// -------------------------------------------------------------------------
+	// pipeline: a chain of stages, each on its own threads, that values of a
+	// given type flow through in order.
+	//
+	// make_pipeline<T>(serial_stage(f), parallel_stage(4, g), ...) starts a
+	// pipeline whose first stage takes a T. Each stage's function takes the
+	// previous stage's result (by value, or by rvalue or const reference),
+	// and the last stage's function returns void. Call push() to send values
+	// in. Call close() to mark the end of the input and wait for every value
+	// to come out of the end; the destructor does that too.
+	//
+	// Stages are connected by bounded single-producer, single-consumer rings
+	// of the values themselves, so values are moved from stage to stage,
+	// never copied, never wrapped in a dispatch_block, and the rings are
+	// allocated up front. When a ring is full, the stage feeding it waits,
+	// and so on back up the chain to push(), so a slow stage slows down the
+	// whole pipeline rather than letting values pile up.
+	//
+	// A serial stage runs on one thread. A parallel stage runs on several,
+	// each taking values in turn, and its function is called from all of
+	// them at once. Values still come out in the order they went in: between
+	// a stage with m threads and one with n there's a ring for each pair, and
+	// the i'th value always goes from thread i % m to thread i % n.
+	//
+	// A thread waiting for its ring spins and yields as its idle_policy
+	// says, then sleeps. Call push() and close() from one thread at a time.
+
+	template <typename F> struct pipeline_stage
+	{
+		F function;
+		size_t threads;
+	};
+
+	// A stage that runs on a single thread.
+	template <typename F>
+	pipeline_stage<typename std::decay<F>::type> serial_stage(F&& function)
+	{
+		return { std::forward<F>(function), 1 };
+	}
+
+	// A stage that runs on the given number of threads.
+	template <typename F>
+	pipeline_stage<typename std::decay<F>::type>
+	parallel_stage(size_t threads, F&& function)
+	{
+		return { std::forward<F>(function), std::max<size_t>(threads, 1) };
+	}
+
+	namespace detail
+	{
+		// A bounded ring between one producer thread and one consumer. Each
+		// side keeps a stale copy of the other's index, so it only touches
+		// the other's cache line when the ring looks full (or empty).
+		template <typename T> class spsc_ring
+		{
+			typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type
+				slot;
+
+			std::unique_ptr<slot[]> _slots;
+			size_t _mask;
+			idle_policy _idle;
+			cache_pad _pad0;
+
+			std::atomic<size_t> _tail; // Written by the producer.
+			size_t _head_seen = 0;
+			cache_pad _pad1;
+
+			std::atomic<size_t> _head; // Written by the consumer.
+			size_t _tail_seen = 0;
+			cache_pad _pad2;
+
+			// For sleeping, once spinning is done.
+			std::atomic<int> _sleeping;
+			std::mutex _mutex;
+			std::condition_variable _cond;
+
+			T* _at(size_t i)
+			{
+				return reinterpret_cast<T*>(&_slots[i & _mask]);
+			}
+
+			template <typename Ready> void _wait(Ready ready)
+			{
+				if (_idle.poll(ready)) return;
+				_sleeping.fetch_add(1);
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					while (!ready())
+						_cond.wait(lock);
+				}
+				_sleeping.fetch_sub(1);
+			}
+
+		public:
+			spsc_ring(size_t capacity, idle_policy idle)
+				: _idle(idle)
+				, _tail(0)
+				, _head(0)
+				, _sleeping(0)
+			{
+				size_t size = 1;
+				while (size < capacity)
+					size *= 2;
+				_slots.reset(new slot[size]);
+				_mask = size - 1;
+			}
+
+			spsc_ring(const spsc_ring&) = delete;
+			spsc_ring& operator=(const spsc_ring&) = delete;
+
+			~spsc_ring()
+			{
+				for (size_t i = _head.load(); i != _tail.load(); ++i)
+					_at(i)->~T();
+			}
+
+			// Wake the other side, if it's asleep.
+			void wake()
+			{
+				if (_sleeping.load(std::memory_order_seq_cst) == 0) return;
+				std::lock_guard<std::mutex> lock(_mutex);
+				_cond.notify_all();
+			}
+
+			// Called by the producer. Waits for room.
+			void push(T&& value)
+			{
+				size_t tail = _tail.load(std::memory_order_relaxed);
+				if (tail - _head_seen > _mask) {
+					_wait([&] {
+						_head_seen = _head.load(std::memory_order_seq_cst);
+						return tail - _head_seen <= _mask;
+					});
+				}
+				// This is sequentially consistent to pair with _wait(): either
+				// we see that the consumer is asleep, or it sees the value.
+				new (_at(tail)) T(std::move(value));
+				_tail.store(tail + 1, std::memory_order_seq_cst);
+				wake();
+			}
+
+			// Called by the consumer. Waits for the next value, and returns
+			// it, still in the ring, or null if the ring is empty and done()
+			// returns true.
+			template <typename Done> T* front(Done done)
+			{
+				size_t head = _head.load(std::memory_order_relaxed);
+				if (head == _tail_seen) {
+					_wait([&] {
+						_tail_seen = _tail.load(std::memory_order_seq_cst);
+						return head != _tail_seen || done();
+					});
+					if (head == _tail_seen) return nullptr;
+				}
+				return _at(head);
+			}
+
+			// Called by the consumer, to free the value front() returned.
+			void pop()
+			{
+				size_t head = _head.load(std::memory_order_relaxed);
+				_at(head)->~T();
+				_head.store(head + 1, std::memory_order_seq_cst);
+				wake();
+			}
+		};
+
+		// The stages of a pipeline after the last one.
+		template <typename T, typename... Fs> class pipeline_chain
+		{
+			static_assert(
+				std::is_void<T>::value,
+				"the last stage of a pipeline must return void");
+
+		public:
+			pipeline_chain(
+				const std::atomic<uint64_t>&, size_t, size_t, idle_policy)
+			{
+			}
+
+			void wake() {}
+			void join() {}
+		};
+
+		// A stage taking values of type T, and the stages after it.
+		template <typename T, typename F, typename... Fs>
+		class pipeline_chain<T, F, Fs...>
+		{
+			typedef decltype(std::declval<F&>()(std::declval<T>())) result_type;
+			typedef pipeline_chain<result_type, Fs...> next_type;
+
+			const std::atomic<uint64_t>& _total; // Values pushed, once closed.
+			F _function;
+			size_t _inputs; // Threads in the stage before.
+			size_t _threads;
+			std::vector<std::unique_ptr<spsc_ring<T>>> _rings;
+			next_type _next;
+			std::unique_ptr<os_thread[]> _workers;
+
+			spsc_ring<T>& _ring(size_t from, size_t to)
+			{
+				return *_rings[from * _threads + to];
+			}
+
+			void _handle(T& value, uint64_t, size_t, std::true_type)
+			{
+				_function(std::move(value));
+			}
+
+			void _handle(T& value, uint64_t i, size_t thread, std::false_type)
+			{
+				_next.push(i, thread, _function(std::move(value)));
+			}
+
+			// Thread t of this stage takes the values i = t, t + n, t + 2n
+			// and so on, until it reaches the end of the input.
+			void _run(size_t t)
+			{
+				for (uint64_t i = t;; i += _threads) {
+					spsc_ring<T>& ring = _ring(size_t(i % _inputs), t);
+					T* value = ring.front([&] {
+						return i >= _total.load(std::memory_order_acquire);
+					});
+					if (!value) return;
+					_handle(*value, i, t, std::is_void<result_type>());
+					ring.pop();
+				}
+			}
+
+		public:
+			pipeline_chain(
+				const std::atomic<uint64_t>& total, size_t inputs,
+				size_t capacity, idle_policy idle,
+				pipeline_stage<F> stage, pipeline_stage<Fs>... rest)
+				: _total(total)
+				, _function(std::move(stage.function))
+				, _inputs(inputs)
+				, _threads(stage.threads)
+				, _next(
+					  total, stage.threads, capacity, idle, std::move(rest)...)
+				, _workers(new os_thread[stage.threads])
+			{
+				for (size_t i = 0; i < _inputs * _threads; ++i)
+					_rings.emplace_back(new spsc_ring<T>(capacity, idle));
+				for (size_t t = 0; t < _threads; ++t)
+					_workers[t].start(thread_options(), [this, t] { _run(t); });
+			}
+
+			// Send the i'th value from the given thread of the stage before.
+			void push(uint64_t i, size_t from, T&& value)
+			{
+				_ring(from, size_t(i % _threads)).push(std::move(value));
+			}
+
+			// Wake every thread, to notice the end of the input.
+			void wake()
+			{
+				for (auto& ring : _rings)
+					ring->wake();
+				_next.wake();
+			}
+
+			// Wait for every thread, which has to be woken first.
+			void join()
+			{
+				for (size_t t = 0; t < _threads; ++t)
+					_workers[t].join();
+				_next.join();
+			}
+		};
+
+		template <typename T, typename... Fs> struct pipeline_state
+		{
+			std::atomic<uint64_t> total;
+			uint64_t pushed = 0;
+			pipeline_chain<T, Fs...> chain;
+
+			pipeline_state(
+				size_t capacity, idle_policy idle,
+				pipeline_stage<Fs>... stages)
+				: total(uint64_t(-1))
+				, chain(total, 1, capacity, idle, std::move(stages)...)
+			{
+			}
+		};
+	} // namespace detail
+
+	template <typename T, typename... Fs> class pipeline
+	{
+		std::unique_ptr<detail::pipeline_state<T, Fs...>> _state;
+
+	public:
+		// Start a pipeline whose rings each hold up to capacity values.
+		explicit pipeline(
+			size_t capacity, idle_policy idle, pipeline_stage<Fs>... stages)
+			: _state(new detail::pipeline_state<T, Fs...>(
+				capacity, idle, std::move(stages)...))
+		{
+		}
+
+		pipeline(pipeline&& other) = default;
+		pipeline& operator=(pipeline&& other) = default;
+
+		// Send a value into the first stage. Waits if it's full.
+		void push(T value)
+		{
+			assert(_state && _state->total.load() == uint64_t(-1));
+			_state->chain.push(_state->pushed++, 0, std::move(value));
+		}
+
+		// Mark the end of the input, then wait for every value to go
+		// through. push() mustn't be called afterwards.
+		void close()
+		{
+			if (!_state || _state->total.load() != uint64_t(-1)) return;
+			_state->total.store(_state->pushed);
+			_state->chain.wake();
+			_state->chain.join();
+		}
+
+		// The number of values pushed so far.
+		uint64_t pushed() const { return _state ? _state->pushed : 0; }
+
+		~pipeline() { close(); }
+	};
+
+	// Start a pipeline taking values of type T, with rings of 256 values.
+	template <typename T, typename... Fs>
+	pipeline<T, Fs...> make_pipeline(pipeline_stage<Fs>... stages)
+	{
+		return pipeline<T, Fs...>(256, idle_policy(), std::move(stages)...);
+	}
+
+	// Start a pipeline with the given ring size and idle_policy.
+	template <typename T, typename... Fs>
+	pipeline<T, Fs...> make_pipeline(
+		size_t capacity, idle_policy idle, pipeline_stage<Fs>... stages)
+	{
+		return pipeline<T, Fs...>(capacity, idle, std::move(stages)...);
+	}
 } // namespace more
 
 #endif // more_dispatch_h
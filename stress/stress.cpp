@@ -0,0 +1,620 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// The queues' own lock timings come from their metrics.
+#ifndef MORE_DISPATCH_METRICS
+#define MORE_DISPATCH_METRICS 1
+#endif
+
+#include "../include/more_dispatch/more_dispatch.h"
+
+// Stress and scalability tests for the queues.
+//
+// The scaling phase floods each kind of queue from 1 up to --max-producers
+// threads, doubling each time. It reports throughput, the latency from
+// dispatch() to each block starting to run, and the lock wait and hold
+// times that dispatch_thread's queue sees. With --perf (Linux only), it
+// also counts cycles, instructions, cache misses and context switches per
+// block.
+//
+// The chaos phase builds and tears down queues over and over, with
+// producers, recursive blocks, stop() and destruction racing each other at
+// random times, and checks that every block that was accepted ran exactly
+// once. It exits with a non-zero status if one didn't.
+//
+// The stress_tsan target is the same program built with ThreadSanitizer;
+// it uses smaller defaults, since everything runs many times slower.
+//
+//   stress [--quick] [--seconds S] [--max-producers N] [--rounds N]
+//          [--seed N] [--perf] [--csv]
+
+namespace
+{
+	typedef std::chrono::steady_clock clock_type;
+
+	uint64_t now_ns()
+	{
+		return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+							clock_type::now().time_since_epoch())
+							.count());
+	}
+
+	double seconds_since(clock_type::time_point start)
+	{
+		return std::chrono::duration<double>(clock_type::now() - start)
+			.count();
+	}
+
+	struct options
+	{
+#if STRESS_TSAN
+		double seconds = 0.05;
+		size_t max_producers = 16;
+		int rounds = 40;
+#else
+		double seconds = 0.2;
+		size_t max_producers = 64;
+		int rounds = 300;
+#endif
+		unsigned seed = 1;
+		bool perf = false;
+		bool csv = false;
+	};
+
+	// -------------------------------------------------------------------------
+	// Hardware and software counters for the whole process, including
+	// threads started after they're opened.
+
+	class perf_counters
+	{
+	public:
+		static const int count = 4;
+
+		static const char* name(int i)
+		{
+			static const char* names[count] = {
+				"cycles", "instructions", "cache-misses", "ctx-switches"
+			};
+			return names[i];
+		}
+
+	private:
+		int _fds[count];
+
+	public:
+		perf_counters()
+		{
+			for (int& fd : _fds)
+				fd = -1;
+		}
+
+		perf_counters(const perf_counters&) = delete;
+		perf_counters& operator=(const perf_counters&) = delete;
+
+		// Open and start the counters. Returns false, with a reason, if the
+		// kernel won't let us.
+		bool start(std::string& error)
+		{
+#if defined(__linux__)
+			const struct
+			{
+				uint32_t type;
+				uint64_t config;
+			} events[count] = {
+				{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+				{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+				{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+				{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+			};
+			for (int i = 0; i < count; ++i) {
+				perf_event_attr attr;
+				memset(&attr, 0, sizeof(attr));
+				attr.size = sizeof(attr);
+				attr.type = events[i].type;
+				attr.config = events[i].config;
+				attr.disabled = 1;
+				attr.inherit = 1;
+				attr.exclude_kernel = events[i].type == PERF_TYPE_HARDWARE;
+				attr.exclude_hv = 1;
+				_fds[i] = int(syscall(
+					SYS_perf_event_open, &attr, 0, -1, -1,
+					PERF_FLAG_FD_CLOEXEC));
+				if (_fds[i] < 0) {
+					error = std::string(name(i)) + ": " + strerror(errno);
+					return false;
+				}
+			}
+			for (int fd : _fds) {
+				ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+				ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+			}
+			return true;
+#else
+			error = "perf counters need Linux";
+			return false;
+#endif
+		}
+
+		// The counts so far. Threads that have exited are included.
+		void read(uint64_t values[count]) const
+		{
+			for (int i = 0; i < count; ++i) {
+				values[i] = 0;
+#if defined(__linux__)
+				if (_fds[i] < 0) continue;
+				ssize_t n = ::read(_fds[i], &values[i], sizeof(values[i]));
+				if (n != ssize_t(sizeof(values[i]))) values[i] = 0;
+#endif
+			}
+		}
+
+		~perf_counters()
+		{
+#if defined(__linux__)
+			for (int fd : _fds)
+				if (fd >= 0) close(fd);
+#endif
+		}
+	};
+
+	// -------------------------------------------------------------------------
+	// Scaling: throughput and latency against the number of producers.
+
+	struct result
+	{
+		std::string queue;
+		size_t producers;
+		uint64_t executed;
+		double seconds;
+		more::histogram_snapshot latency;
+		bool has_lock = false;
+		more::histogram_snapshot lock_wait;
+		more::histogram_snapshot lock_hold;
+		bool has_perf = false;
+		uint64_t perf[perf_counters::count];
+	};
+
+	// Each producer keeps a bounded number of its blocks in flight, so a
+	// fast producer can't bury a slow consumer. The queues run saturated, so
+	// latency grows with the number of producers; the curve's shape is the
+	// point.
+	struct producer_state
+	{
+		std::atomic<uint64_t> executed;
+		more::latency_histogram* latency;
+
+		producer_state() : executed(0), latency(nullptr) {}
+	};
+
+	const uint64_t in_flight = 1024;
+
+	template <typename Queue>
+	void produce(
+		Queue& queue, producer_state& state, const std::atomic<bool>& done,
+		uint64_t& accepted)
+	{
+		producer_state* s = &state;
+		uint64_t sent = 0;
+		while (!done.load(std::memory_order_relaxed)) {
+			while (sent - s->executed.load(std::memory_order_acquire)
+				   >= in_flight) {
+				if (done.load(std::memory_order_relaxed)) break;
+				std::this_thread::yield();
+			}
+			uint64_t start = now_ns();
+			bool ok = queue.dispatch([s, start] {
+				s->latency->record(now_ns() - start);
+				s->executed.fetch_add(1, std::memory_order_release);
+			});
+			if (!ok) break;
+			++sent;
+		}
+		accepted = sent;
+	}
+
+	template <typename Queue> void add_lock_times(Queue&, result&) {}
+
+	void add_lock_times(more::dispatch_thread& thread, result& r)
+	{
+		more::queue_metrics m = thread.queue().metrics();
+		r.has_lock = true;
+		r.lock_wait = m.lock_wait;
+		r.lock_hold = m.lock_hold;
+	}
+
+	bool perf_reported = false;
+
+	template <typename Queue>
+	result scale(const char* name, size_t producers, const options& opts)
+	{
+		result r;
+		r.queue = name;
+		r.producers = producers;
+
+		// Open the counters first, so that they follow the queue's threads.
+		perf_counters counters;
+		std::string error;
+		r.has_perf = opts.perf && counters.start(error);
+		if (opts.perf && !r.has_perf && !perf_reported) {
+			fprintf(stderr, "perf counters unavailable: %s\n", error.c_str());
+			perf_reported = true;
+		}
+
+		more::latency_histogram latency;
+		std::vector<producer_state> states(producers);
+		std::vector<uint64_t> accepted(producers, 0);
+		{
+			Queue queue;
+			std::atomic<bool> done(false);
+			std::vector<std::thread> threads;
+			clock_type::time_point start = clock_type::now();
+			for (size_t i = 0; i < producers; ++i) {
+				states[i].latency = &latency;
+				threads.emplace_back([&, i] {
+					produce(queue, states[i], done, accepted[i]);
+				});
+			}
+			std::this_thread::sleep_for(
+				std::chrono::duration<double>(opts.seconds));
+			done = true;
+			for (auto& t : threads)
+				t.join();
+			for (size_t i = 0; i < producers; ++i) {
+				while (states[i].executed.load() < accepted[i])
+					std::this_thread::yield();
+			}
+			r.seconds = seconds_since(start);
+			add_lock_times(queue, r);
+		}
+		if (r.has_perf) counters.read(r.perf);
+
+		r.executed = 0;
+		for (uint64_t a : accepted)
+			r.executed += a;
+		r.latency = latency.snapshot();
+		return r;
+	}
+
+	// The pool and serial queue get a fixed number of worker threads.
+	struct pool_2 : more::dispatch_pool
+	{
+		pool_2() : more::dispatch_pool(2) {}
+	};
+
+	struct pool_4 : more::dispatch_pool
+	{
+		pool_4() : more::dispatch_pool(4) {}
+	};
+
+	struct serial_on_pool_4
+	{
+		more::dispatch_pool pool;
+		more::serial_queue queue;
+
+		serial_on_pool_4() : pool(4), queue(pool) {}
+
+		template <typename F> bool dispatch(F&& f)
+		{
+			return queue.dispatch(std::forward<F>(f));
+		}
+	};
+
+	double us(uint64_t ns) { return double(ns) / 1000.0; }
+
+	void print_header(const options& opts)
+	{
+		if (opts.csv) {
+			printf(
+				"queue,producers,blocks_per_second,p50_us,p99_us,p999_us,"
+				"max_us,lock_wait_p99_us,lock_hold_p99_us");
+			for (int i = 0; i < perf_counters::count; ++i)
+				printf(",%s_per_block", perf_counters::name(i));
+			printf("\n");
+			return;
+		}
+		printf(
+			"%-22s %5s %12s %9s %9s %9s %9s %10s %10s", "queue", "prod",
+			"blocks/s", "p50 us", "p99 us", "p999 us", "max us", "lkwait99",
+			"lkhold99");
+		if (opts.perf) {
+			printf(
+				" %9s %9s %9s %9s", "cyc/blk", "ins/blk", "miss/blk",
+				"ctxsw");
+		}
+		printf("\n");
+	}
+
+	void print_result(const result& r, const options& opts)
+	{
+		const more::histogram_snapshot& l = r.latency;
+		double rate = double(r.executed) / r.seconds;
+		if (opts.csv) {
+			printf(
+				"%s,%d,%.0f,%.1f,%.1f,%.1f,%.1f", r.queue.c_str(),
+				int(r.producers), rate, us(l.percentile(0.5)),
+				us(l.percentile(0.99)), us(l.percentile(0.999)), us(l.max));
+			if (r.has_lock) {
+				printf(
+					",%.2f,%.2f", us(r.lock_wait.percentile(0.99)),
+					us(r.lock_hold.percentile(0.99)));
+			} else {
+				printf(",,");
+			}
+			for (int i = 0; i < perf_counters::count; ++i) {
+				if (r.has_perf && r.executed > 0) {
+					printf(",%.1f", double(r.perf[i]) / double(r.executed));
+				} else {
+					printf(",");
+				}
+			}
+			printf("\n");
+			return;
+		}
+
+		printf(
+			"%-22s %5d %12.0f %9.1f %9.1f %9.1f %9.1f", r.queue.c_str(),
+			int(r.producers), rate, us(l.percentile(0.5)),
+			us(l.percentile(0.99)), us(l.percentile(0.999)), us(l.max));
+		if (r.has_lock) {
+			printf(
+				" %10.2f %10.2f", us(r.lock_wait.percentile(0.99)),
+				us(r.lock_hold.percentile(0.99)));
+		} else {
+			printf(" %10s %10s", "-", "-");
+		}
+		if (r.has_perf && r.executed > 0) {
+			double n = double(r.executed);
+			printf(
+				" %9.0f %9.0f %9.2f %9llu", double(r.perf[0]) / n,
+				double(r.perf[1]) / n, double(r.perf[2]) / n,
+				(unsigned long long)r.perf[3]);
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	template <typename Queue>
+	void scale_all(const char* name, const options& opts)
+	{
+		for (size_t p = 1; p <= opts.max_producers; p *= 2)
+			print_result(scale<Queue>(name, p, opts), opts);
+	}
+
+	// -------------------------------------------------------------------------
+	// Chaos: random stop and destroy timing, checking that no accepted block
+	// is lost or run twice.
+
+	struct chaos_counters
+	{
+		std::atomic<uint64_t> accepted;
+		std::atomic<uint64_t> executed;
+
+		chaos_counters() : accepted(0), executed(0) {}
+	};
+
+	// A block that dispatches a copy of itself, until its depth runs out or
+	// the queue refuses.
+	template <typename Queue> struct recursive_block
+	{
+		Queue* queue;
+		chaos_counters* counters;
+		int depth;
+
+		void operator()() const
+		{
+			counters->executed.fetch_add(1, std::memory_order_relaxed);
+			if (depth == 0) return;
+			recursive_block next = { queue, counters, depth - 1 };
+			if (queue->dispatch(next))
+				counters->accepted.fetch_add(1, std::memory_order_relaxed);
+		}
+	};
+
+	// Run producers against a queue, then stop them at a random moment,
+	// either by stopping the queue under them or by telling them to quit
+	// (leaving the destructor to stop it). Depth is how many copies of
+	// itself each block may dispatch; it must be zero for a ring, which
+	// would deadlock if a block waited for room in its own queue.
+	template <typename Queue>
+	void chaos_round(
+		Queue& queue, chaos_counters& counters, std::mt19937& rng,
+		int depth)
+	{
+		typedef recursive_block<Queue> block;
+		size_t producers = 1 + rng() % 8;
+		std::atomic<bool> quit(false);
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < producers; ++i) {
+			int d = int(rng() % unsigned(depth + 1));
+			threads.emplace_back([&, d] {
+				for (int n = 0; n < 100000 && !quit; ++n) {
+					block b = { &queue, &counters, d };
+					if (!queue.dispatch(b)) return;
+					counters.accepted.fetch_add(1, std::memory_order_relaxed);
+					if (n % 64 == 0) std::this_thread::yield();
+				}
+			});
+		}
+		std::this_thread::sleep_for(std::chrono::microseconds(rng() % 2000));
+		if (rng() % 2) queue.stop();
+		quit = true;
+		for (auto& t : threads)
+			t.join();
+		if (rng() % 2)
+			std::this_thread::sleep_for(
+				std::chrono::microseconds(rng() % 500));
+	}
+
+	// A bare dispatch_queue, with its consumer and a thread waiting for it
+	// to drain, and stop() called from a producer, a block or this thread.
+	void chaos_queue(chaos_counters& counters, std::mt19937& rng)
+	{
+		typedef recursive_block<more::dispatch_queue> block;
+		more::dispatch_queue queue;
+		std::atomic<bool> drained(false);
+		std::thread consumer([&] { queue.run_forever(); });
+		std::thread waiter([&] {
+			queue.wait_until_done();
+			drained = true;
+		});
+
+		unsigned who = rng() % 3;
+		size_t producers = 1 + rng() % 8;
+		size_t stopper = rng() % producers;
+		int after = int(rng() % 20000);
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < producers; ++i) {
+			threads.emplace_back([&, i] {
+				for (int n = 0;; ++n) {
+					if (who == 0 && i == stopper && n == after) queue.stop();
+					if (who == 1 && i == stopper && n == after) {
+						more::dispatch_queue* q = &queue;
+						queue.dispatch([q] { q->stop(); });
+					}
+					block b = { &queue, &counters, 2 };
+					if (!queue.dispatch(b)) return;
+					counters.accepted.fetch_add(1, std::memory_order_relaxed);
+				}
+			});
+		}
+		std::this_thread::sleep_for(std::chrono::microseconds(rng() % 2000));
+		if (who == 2) queue.stop();
+		for (auto& t : threads)
+			t.join();
+		// The stopping producer may have quit early, before it got to
+		// stop(), if another thread stopped the queue first.
+		queue.stop();
+		consumer.join();
+		waiter.join();
+		if (!drained) {
+			fprintf(stderr, "FAIL: wait_until_done() returned early\n");
+			exit(1);
+		}
+	}
+
+	bool chaos(const options& opts)
+	{
+		std::mt19937 rng(opts.seed);
+		const char* names[] = { "dispatch_queue", "dispatch_thread",
+								"ring_dispatch_thread", "dispatch_pool",
+								"serial_queue" };
+		std::vector<uint64_t> blocks(5, 0);
+		bool ok = true;
+		for (int round = 0; round < opts.rounds; ++round) {
+			int kind = round % 5;
+			chaos_counters counters;
+			switch (kind) {
+				case 0: chaos_queue(counters, rng); break;
+				case 1:
+				{
+					more::dispatch_thread q;
+					chaos_round(q, counters, rng, 3);
+					break;
+				}
+				case 2:
+				{
+					more::ring_dispatch_thread q;
+					chaos_round(q, counters, rng, 0);
+					break;
+				}
+				case 3:
+				{
+					more::dispatch_pool q(1 + rng() % 4);
+					chaos_round(q, counters, rng, 3);
+					break;
+				}
+				case 4:
+				{
+					more::dispatch_pool pool(1 + rng() % 4);
+					more::serial_queue q(pool);
+					chaos_round(q, counters, rng, 3);
+					break;
+				}
+			}
+			uint64_t accepted = counters.accepted.load();
+			uint64_t executed = counters.executed.load();
+			blocks[kind] += executed;
+			if (accepted != executed) {
+				fprintf(
+					stderr, "FAIL: %s round %d accepted %llu but ran %llu\n",
+					names[kind], round, (unsigned long long)accepted,
+					(unsigned long long)executed);
+				ok = false;
+			}
+		}
+		if (!opts.csv) {
+			printf("\nchaos: %d rounds, seed %u\n", opts.rounds, opts.seed);
+			for (int i = 0; i < 5; ++i)
+				printf(
+					"  %-22s %llu blocks\n", names[i],
+					(unsigned long long)blocks[i]);
+			printf("  %s\n", ok ? "ok" : "FAILED");
+		}
+		return ok;
+	}
+
+	bool parse(int argc, const char* argv[], options& opts)
+	{
+		for (int i = 1; i < argc; ++i) {
+			std::string arg = argv[i];
+			bool has_value = i + 1 < argc;
+			if (arg == "--quick") {
+				opts.seconds = 0.02;
+				opts.max_producers = 8;
+				opts.rounds = 30;
+			} else if (arg == "--seconds" && has_value) {
+				opts.seconds = atof(argv[++i]);
+			} else if (arg == "--max-producers" && has_value) {
+				opts.max_producers = size_t(atoi(argv[++i]));
+			} else if (arg == "--rounds" && has_value) {
+				opts.rounds = atoi(argv[++i]);
+			} else if (arg == "--seed" && has_value) {
+				opts.seed = unsigned(atoi(argv[++i]));
+			} else if (arg == "--perf") {
+				opts.perf = true;
+			} else if (arg == "--csv") {
+				opts.csv = true;
+			} else {
+				fprintf(
+					stderr,
+					"usage: %s [--quick] [--seconds S] [--max-producers N] "
+					"[--rounds N] [--seed N] [--perf] [--csv]\n",
+					argv[0]);
+				return false;
+			}
+		}
+		return true;
+	}
+} // namespace
+
+int main(int argc, const char* argv[])
+{
+	options opts;
+	if (!parse(argc, argv, opts)) return 2;
+
+	print_header(opts);
+	scale_all<more::dispatch_thread>("dispatch_thread", opts);
+	scale_all<more::ring_dispatch_thread>("ring_dispatch_thread", opts);
+	scale_all<pool_2>("dispatch_pool(2)", opts);
+	scale_all<pool_4>("dispatch_pool(4)", opts);
+	scale_all<serial_on_pool_4>("serial_queue(pool 4)", opts);
+
+	return chaos(opts) ? 0 : 1;
+}
@@ -1,8 +1,20 @@
 #include <assert.h>
 #include <stdio.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <poll.h>
+#endif
 
 #include "../include/more_dispatch/more_dispatch.h"
 
@@ -11,6 +23,7 @@ void test_dispatch_queue()
 	printf("Basic dispatch_queue test (no thread)...\n");
 
 	more::dispatch_queue t;
+	t.reserve(16);
 	t.dispatch([] { printf(" Hello"); });
 	t.dispatch([] { printf(" world!"); });
 	t.dispatch([] { printf("\n"); });
@@ -52,10 +65,1393 @@ void test_infinite_recursion()
 	printf(" count1: %d, count2: %d\n", count1, count2);
 }
 
+void fan_out(std::atomic<int>& counter, more::dispatch_pool& pool, int depth)
+{
+	++counter;
+	if (depth == 0) return;
+	for (int i = 0; i < 2; ++i)
+		pool.dispatch([&, depth] { fan_out(counter, pool, depth - 1); });
+}
+
+void test_dispatch_pool()
+{
+	printf("Testing dispatch_pool...\n");
+	std::atomic<int> count(0);
+	std::atomic<int> tree(0);
+	{
+		more::dispatch_pool pool(4);
+		assert(pool.thread_count() == 4);
+		for (int i = 0; i < 1000; ++i)
+			pool.dispatch([&] { ++count; });
+		pool.dispatch([&] { fan_out(tree, pool, 10); });
+		while (tree < 2047)
+			std::this_thread::yield();
+	}
+	printf(" count: %d, tree: %d\n", count.load(), tree.load());
+	assert(count == 1000);
+	assert(tree == 2047);
+
+	more::dispatch_pool pool;
+	pool.stop();
+	bool success = pool.dispatch([] { printf("This should not be printed\n"); });
+	assert(!success);
+}
+
+struct alignas(64) over_aligned
+{
+	int value;
+};
+
+void test_heap_fallback()
+{
+	printf("Testing dispatch_block heap fallback...\n");
+
+	typedef more::dispatch_block block;
+	size_t before = block::heap_allocations();
+
+	char big[256] = "big";
+	over_aligned aligned;
+	aligned.value = 42;
+	static_assert(block::fits_inline<void (*)()>::value, "should fit");
+	static_assert(!block::fits_inline<decltype(aligned)>::value, "too big");
+
+	more::dispatch_queue t;
+	t.dispatch([] { printf(" Small"); });
+	t.dispatch([big] { printf(" %s", big); });
+	t.dispatch([aligned] {
+		assert(uintptr_t(&aligned) % 64 == 0);
+		printf(" %d\n", aligned.value);
+	});
+	t.stop();
+	t.run_forever();
+
+	printf(" heap allocations: %d\n", int(block::heap_allocations() - before));
+	assert(block::heap_allocations() - before == 2);
+
+	typedef more::basic_dispatch_block<64, false> inline_only;
+	std::vector<inline_only> v;
+	char medium[48] = "Inline only";
+	v.push_back(inline_only([medium] { printf(" %s\n", medium); }));
+	v.back().invoke();
+}
+
+void test_ring_dispatch_queue()
+{
+	printf("Testing ring_dispatch_queue...\n");
+	{
+		more::ring_dispatch_queue t(3);
+		assert(t.capacity() == 4);
+		t.dispatch([] { printf(" Hello"); });
+		t.dispatch([] { printf(" world!"); });
+		t.dispatch([] { printf("\n"); });
+		t.stop();
+
+		bool success =
+			t.dispatch([] { printf("This should not be printed\n"); });
+		assert(!success);
+
+		t.run_forever();
+	}
+
+	int count = 0;
+	{
+		more::ring_dispatch_thread t(64);
+		std::vector<std::thread> producers;
+		for (int i = 0; i < 4; ++i) {
+			producers.emplace_back([&] {
+				for (int j = 0; j < 10000; ++j)
+					t.dispatch([&] { ++count; });
+			});
+		}
+		for (auto& p : producers)
+			p.join();
+	}
+	printf(" count: %d\n", count);
+	assert(count == 40000);
+}
+
+void test_run_once()
+{
+	printf("Testing run_once() from another thread...\n");
+	int count = 0;
+	std::atomic<bool> stopped(false);
+	std::thread consumer;
+	{
+		more::dispatch_queue t;
+		consumer = std::thread([&] {
+			while (!stopped)
+				t.run_once();
+		});
+		for (int i = 0; i < 1000; ++i)
+			t.dispatch([&] { ++count; });
+		t.dispatch([&] { stopped = true; });
+	}
+	consumer.join();
+	printf(" count: %d\n", count);
+	assert(count == 1000);
+}
+
+void test_run_once_budget()
+{
+	printf("Testing run_once() with a budget...\n");
+	more::dispatch_queue q;
+	std::vector<int> order;
+	for (int i = 0; i < 100; ++i)
+		q.dispatch([&order, i] { order.push_back(i); });
+	assert(q.run_once(30) == 70);
+	assert(order.size() == 30);
+
+	// The rest of the batch runs before anything dispatched since, except
+	// for higher qos classes.
+	for (int i = 100; i < 110; ++i)
+		q.dispatch([&order, i] { order.push_back(i); });
+	q.dispatch(more::qos::interactive, [&] { order.push_back(-1); });
+	assert(q.run_once(51) == 30);
+	assert(order[30] == -1);
+	order.erase(order.begin() + 30);
+	assert(q.run_once(1000) == 0);
+	for (int i = 0; i < 110; ++i)
+		assert(order[i] == i);
+
+	int slow = 0;
+	for (int i = 0; i < 100; ++i)
+		q.dispatch([&] {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			++slow;
+		});
+	size_t left = q.run_once(1000, std::chrono::milliseconds(10));
+	printf(" ran %d of 100 slow blocks in 10ms\n", slow);
+	assert(left > 0 && slow + left == 100);
+	while (q.run_once(1000, std::chrono::milliseconds(10)) > 0)
+		;
+	assert(slow == 100);
+
+	// run_forever() finishes what run_once() left.
+	for (int i = 0; i < 10; ++i)
+		q.dispatch([&] { ++slow; });
+	assert(q.run_once(5) == 5);
+	q.stop();
+	q.run_forever();
+	assert(slow == 110);
+}
+
+#if defined(__linux__)
+void test_native_handle()
+{
+	printf("Testing native_handle()...\n");
+	typedef std::chrono::steady_clock clock;
+	more::dispatch_queue q;
+	int fd = q.native_handle();
+	assert(q.native_handle() == fd);
+	auto readable = [fd](int timeout_ms) {
+		pollfd p = { fd, POLLIN, 0 };
+		return poll(&p, 1, timeout_ms) == 1;
+	};
+	assert(!readable(0));
+
+	// A burst of dispatches signals the handle once.
+	std::atomic<int> count(0);
+	for (int i = 0; i < 3; ++i)
+		q.dispatch([&] { ++count; });
+	uint64_t signals = 0;
+	assert(read(fd, &signals, sizeof(signals)) == sizeof(signals));
+	assert(signals == 1);
+	q.run_once();
+	assert(count == 3 && !readable(0));
+
+	// An event loop sleeps until there are blocks, or a timer is due.
+	bool fired = false;
+	q.dispatch_after(std::chrono::milliseconds(20), [&] { fired = true; });
+	assert(readable(0));
+	std::thread producer([&] {
+		for (int i = 0; i < 100; ++i) {
+			q.dispatch([&] { ++count; });
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+	});
+	int wakeups = 0;
+	while (!fired) {
+		auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+			q.next_timer() - clock::now());
+		readable(std::max(0, int(wait.count()) + 1));
+		q.run_once();
+		++wakeups;
+	}
+	producer.join();
+	q.run_once();
+	assert(q.next_timer() == clock::time_point::max());
+	printf(" count: %d, wakeups: %d\n", count.load(), wakeups);
+	assert(count == 103);
+
+	// Stopping the queue wakes the loop too.
+	q.stop();
+	assert(readable(0));
+	q.run_once();
+	assert(!readable(0));
+}
+#endif
+
+void test_idle_policy()
+{
+	printf("Testing idle_policy...\n");
+	std::atomic<int> count(0);
+	{
+		more::dispatch_thread t(more::idle_policy::low_latency());
+		more::ring_dispatch_thread r(16, more::idle_policy(1000, 10));
+		for (int i = 0; i < 100; ++i) {
+			t.dispatch([&] { ++count; });
+			r.dispatch([&] { ++count; });
+			std::this_thread::sleep_for(std::chrono::microseconds(10));
+		}
+	}
+	printf(" count: %d\n", count.load());
+	assert(count == 200);
+}
+
+void test_dispatch_bulk()
+{
+	printf("Testing dispatch_bulk...\n");
+	std::atomic<int> count(0);
+	{
+		more::dispatch_thread t;
+		more::ring_dispatch_thread r(256);
+		more::dispatch_batch batch;
+		for (int round = 0; round < 10; ++round) {
+			for (int i = 0; i < 1000; ++i)
+				batch.dispatch([&] { ++count; });
+			assert(batch.size() == 1000);
+			t.dispatch_bulk(batch);
+			assert(batch.empty());
+		}
+
+		std::vector<std::function<void()>> functions;
+		for (int i = 0; i < 1000; ++i)
+			functions.push_back([&] { ++count; });
+		t.dispatch_bulk(functions.begin(), functions.end());
+
+		// The ring isn't big enough for this, so it must run while we push.
+		for (int i = 0; i < 1000; ++i)
+			batch.dispatch([&] { ++count; });
+		r.dispatch_bulk(batch);
+		r.stop();
+		assert(!r.dispatch_bulk(functions.begin(), functions.end()));
+	}
+	printf(" count: %d\n", count.load());
+	assert(count == 12000);
+}
+
+void test_dispatch_apply()
+{
+	printf("Testing dispatch_apply...\n");
+	more::dispatch_pool pool(4);
+
+	std::vector<size_t> squares(10007);
+	more::dispatch_apply(pool, squares.size(), [&](size_t i) {
+		squares[i] = i * i;
+	});
+	for (size_t i = 0; i < squares.size(); ++i)
+		assert(squares[i] == i * i);
+
+	std::atomic<int> count(0);
+	more::dispatch_apply(pool, 0, [&](size_t) { ++count; });
+	more::dispatch_apply(pool, 1, [&](size_t) { ++count; });
+	assert(count == 1);
+
+	// Nested calls from inside the pool.
+	more::dispatch_apply(pool, 8, [&](size_t) {
+		more::dispatch_apply(pool, 100, [&](size_t) { ++count; });
+	});
+	printf(" count: %d\n", count.load());
+	assert(count == 801);
+
+	// An exception waits for the other chunks, then reaches the caller.
+	std::atomic<int> running(0);
+	bool caught = false;
+	try {
+		more::dispatch_apply(pool, 1000, [&](size_t i) {
+			++running;
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+			--running;
+			if (i == 500) throw std::runtime_error("failed");
+		});
+	} catch (const std::runtime_error& e) {
+		caught = std::string(e.what()) == "failed";
+		assert(running == 0);
+	}
+	assert(caught);
+}
+
+int fib(more::dispatch_pool& pool, int n)
+{
+	if (n < 2) return n;
+	int a, b;
+	more::parallel_invoke(
+		pool, [&] { a = fib(pool, n - 1); }, [&] { b = fib(pool, n - 2); });
+	return a + b;
+}
+
+void test_fork_join()
+{
+	printf("Testing fork/join...\n");
+
+	// Parents wait for their children without blocking a worker, so this
+	// can't deadlock, even on a single thread.
+	more::dispatch_pool one(1);
+	more::future<int> f = more::dispatch_async(one, [&] {
+		return fib(one, 16);
+	});
+	assert(f.get() == 987);
+
+	more::dispatch_pool pool(4);
+	std::atomic<int> count(0);
+	{
+		more::fork_join scope(pool);
+		for (int i = 0; i < 100; ++i)
+			scope.spawn([&] { ++count; });
+		scope.sync();
+		assert(count == 100);
+		scope.spawn([&] { ++count; });
+	}
+	assert(count == 101);
+
+	std::vector<int> values(200000);
+	for (size_t i = 0; i < values.size(); ++i)
+		values[i] = int((i * 7919) % 1009);
+	long long sum = more::parallel_reduce(
+		pool, values.begin(), values.end(), 7LL, [](long long a, long long b) {
+			return a + b;
+		});
+	long long expected = 7;
+	for (int v : values)
+		expected += v;
+	assert(sum == expected);
+
+	// The order of the operands is kept.
+	std::vector<std::string> letters;
+	std::string alphabet = ">";
+	for (int i = 0; i < 1000; ++i) {
+		letters.push_back(std::string(1, char('a' + i % 26)));
+		alphabet += letters.back();
+	}
+	std::string joined = more::parallel_reduce(
+		pool,
+		letters.begin(),
+		letters.end(),
+		std::string(">"),
+		[](const std::string& a, const std::string& b) { return a + b; },
+		16);
+	assert(joined == alphabet);
+
+	std::vector<int> sorted = values;
+	more::parallel_sort(pool, sorted.begin(), sorted.end());
+	assert(std::is_sorted(sorted.begin(), sorted.end()));
+	more::parallel_sort(
+		pool, sorted.begin(), sorted.end(), std::greater<int>(), 100);
+	assert(std::is_sorted(sorted.rbegin(), sorted.rend()));
+	std::sort(values.begin(), values.end(), std::greater<int>());
+	assert(values == sorted);
+
+	// A stopped pool runs spawned blocks right away.
+	one.stop();
+	more::parallel_invoke(one, [&] { ++count; }, [&] { ++count; });
+	printf(" fib: %d, sum: %lld\n", fib(pool, 20), sum);
+	assert(count == 103);
+}
+
+void test_pipeline()
+{
+	printf("Testing pipeline...\n");
+	size_t heap = more::dispatch_block::heap_allocations();
+
+	// Small rings, so the slow last stage holds the others back.
+	std::atomic<int> in_flight(0);
+	int most_in_flight = 0;
+	long long sum = 0;
+	int next = 0;
+	bool in_order = true;
+	{
+		auto p = more::make_pipeline<std::string>(
+			4,
+			more::idle_policy(),
+			more::serial_stage([&](std::string s) {
+				++in_flight;
+				return std::unique_ptr<int>(new int(std::stoi(s)));
+			}),
+			more::parallel_stage(3, [](std::unique_ptr<int> i) {
+				*i *= *i;
+				return i;
+			}),
+			more::serial_stage([&](std::unique_ptr<int> i) {
+				most_in_flight = std::max(most_in_flight, in_flight.load());
+				--in_flight;
+				in_order = in_order && *i == next * next;
+				++next;
+				sum += *i;
+				if (next % 100 == 0)
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}));
+		for (int i = 0; i < 1000; ++i)
+			p.push(std::to_string(i));
+		p.close();
+		assert(p.pushed() == 1000);
+	}
+	printf(" sum: %lld, most in flight: %d\n", sum, most_in_flight);
+	assert(next == 1000 && in_order);
+	assert(sum == 332833500LL);
+	// Two sets of three rings, plus one in each thread.
+	assert(most_in_flight <= 2 * 3 * 4 + 5);
+	assert(more::dispatch_block::heap_allocations() == heap);
+
+	// An empty pipeline closes right away.
+	auto empty = more::make_pipeline<int>(
+		more::parallel_stage(2, [](int) {}));
+	empty.close();
+}
+
+void test_futures()
+{
+	printf("Testing dispatch_async and futures...\n");
+	more::dispatch_thread a;
+	more::dispatch_pool b(2);
+
+	more::future<int> f = more::dispatch_async(a, [] { return 42; });
+	assert(f.valid());
+	assert(f.get() == 42);
+	assert(!f.valid());
+
+	more::future<std::string> g =
+		more::dispatch_async(b, [] { return std::string("Hello"); })
+			.then(a, [](std::string s) { return s + " world!"; });
+	more::future<size_t> h =
+		std::move(g).then(b, [](std::string s) { return s.size(); });
+	assert(h.get() == 12);
+
+	std::atomic<int> count(0);
+	more::future<void> v = more::dispatch_async(a, [&] { ++count; });
+	v.wait();
+	assert(v.ready() && !v.broken());
+	more::future<int> w = v.then(a, [&] { return ++count; });
+	assert(w.get() == 2);
+
+	more::dispatch_thread stopped;
+	stopped.stop();
+	assert(!more::dispatch_async(stopped, [] { return 0; }).valid());
+
+	// A continuation onto a stopped queue is dropped, and breaks its future.
+	more::future<int> x = more::dispatch_async(a, [] { return 1; })
+							  .then(stopped, [](int i) { return i + 1; });
+	x.wait();
+	assert(x.broken());
+	bool threw = false;
+	try {
+		x.get();
+	} catch (const std::future_error& e) {
+		threw = e.code() == std::future_errc::broken_promise;
+	}
+	assert(threw && !x.valid());
+	printf(" count: %d\n", count.load());
+}
+
+void test_dispatch_group()
+{
+	printf("Testing dispatch_group...\n");
+	more::dispatch_thread a;
+	more::ring_dispatch_thread b;
+	more::dispatch_pool c(2);
+	more::dispatch_thread main_queue;
+
+	std::atomic<int> count(0);
+	std::atomic<int> notified(-1);
+	more::dispatch_group group;
+	for (int i = 0; i < 100; ++i) {
+		group.dispatch(a, [&] { ++count; });
+		group.dispatch(b, [&] { ++count; });
+		group.dispatch(c, [&] { ++count; });
+	}
+	group.notify(main_queue, [&] { notified = count.load(); });
+	group.wait();
+	assert(group.empty());
+	assert(count == 300);
+
+	// The group can be reused once it's empty.
+	group.enter();
+	c.dispatch([&] {
+		++count;
+		group.leave();
+	});
+	assert(group.wait_for(std::chrono::seconds(10)));
+	assert(count == 301);
+
+	more::dispatch_thread stopped;
+	stopped.stop();
+	assert(!group.dispatch(stopped, [&] { ++count; }));
+	assert(group.empty());
+
+	// Blocks the queue drops leave the group without running.
+	{
+		more::dispatch_queue q(2, more::overflow_policy::drop_oldest);
+		for (int i = 0; i < 5; ++i)
+			assert(group.dispatch(q, [&] { ++count; }));
+		q.stop();
+		q.run_forever();
+		assert(q.dropped() == 3);
+	}
+	assert(group.empty());
+	assert(count == 303);
+
+	// Wait for the notification to arrive.
+	more::dispatch_async(main_queue, [] {}).wait();
+	printf(" count: %d, notified: %d\n", count.load(), notified.load());
+	assert(notified == 300);
+}
+
+void test_cancellation()
+{
+	printf("Testing cancellation...\n");
+	more::dispatch_queue q;
+	int count = 0;
+	std::shared_ptr<int> capture = std::make_shared<int>(0);
+	more::cancellation_token token;
+	more::cancellation_token other;
+	for (int i = 0; i < 10; ++i) {
+		more::dispatch(q, token, [&count, capture] { ++count; });
+		more::dispatch(q, other, [&] { count += 100; });
+	}
+	more::dispatch(q, token.child(), [&] { ++count; });
+	assert(token.cancel() && !token.cancel());
+	assert(token.cancelled() && !other.cancelled());
+	q.run_once();
+	assert(count == 1000);
+	assert(capture.use_count() == 1); // Skipped blocks are still freed.
+
+	// Cancelling a group cancels its subtree, even blocks dispatched later.
+	int ran = 0;
+	bool notified = false;
+	{
+		more::dispatch_group parent;
+		more::dispatch_group child(parent);
+		parent.dispatch(q, [&] {
+			++ran;
+			child.dispatch(q, [&] { ran += 100; });
+		});
+		child.dispatch(q, [&] {
+			++ran;
+			parent.cancel();
+			child.dispatch(q, [&] { ran += 100; });
+		});
+		child.notify(q, [&] { notified = true; });
+		q.run_once();
+		assert(ran == 2 && child.cancelled());
+		q.run_once();
+		assert(parent.empty() && child.empty());
+		q.run_once();
+		assert(notified);
+
+		more::dispatch_group linked(other);
+		assert(!linked.cancelled());
+		other.cancel();
+		assert(linked.cancelled() && parent.token().child().cancelled());
+	}
+	printf(" count: %d, ran: %d\n", count, ran);
+	assert(ran == 2);
+}
+
+void test_qos()
+{
+	printf("Testing qos classes...\n");
+	std::string order;
+	{
+		more::dispatch_queue t;
+		t.dispatch(more::qos::background, [&] { order += "b"; });
+		t.dispatch([&] { order += "n"; });
+		t.dispatch(more::qos::interactive, [&] { order += "i"; });
+		t.dispatch(more::qos::background, [&] {
+			order += "b";
+			t.dispatch(more::qos::interactive, [&] { order += "I"; });
+		});
+		t.dispatch(more::qos::background, [&] { order += "b"; });
+		t.run_once();
+		t.stop();
+		t.run_forever();
+	}
+	printf(" order: %s\n", order.c_str());
+	assert(order == "inbbIb");
+
+	// A self-perpetuating stream of interactive blocks can't starve the
+	// background blocks.
+	std::atomic<int> interactive(0);
+	std::atomic<int> background(0);
+	int interactive_before_background = 0;
+	std::function<void()> chain;
+	{
+		more::dispatch_thread t;
+		chain = [&] {
+			if (++interactive < 1000)
+				t.dispatch(more::qos::interactive, chain);
+		};
+		t.dispatch([&] {
+			for (int i = 0; i < 10; ++i) {
+				t.dispatch(more::qos::background, [&] {
+					++background;
+					interactive_before_background = interactive.load();
+				});
+			}
+			t.dispatch(more::qos::interactive, chain);
+		});
+		while (interactive < 1000)
+			std::this_thread::yield();
+	}
+	printf(
+		" interactive: %d, background: %d after %d\n",
+		interactive.load(),
+		background.load(),
+		interactive_before_background);
+	assert(background == 10);
+	assert(interactive_before_background < 1000);
+
+	// Only consecutive preemptions count towards the starvation limit: a
+	// background block that runs normally starts the count again.
+	order.clear();
+	{
+		more::dispatch_queue q;
+		int left = 0;
+		std::function<void()> step = [&] {
+			order += "i";
+			if (--left > 0) q.dispatch(more::qos::interactive, step);
+		};
+		left = 10;
+		q.dispatch(more::qos::interactive, step);
+		q.dispatch(more::qos::background, [&] {
+			order += "B";
+			left = 40;
+			q.dispatch(more::qos::interactive, step);
+		});
+		for (int i = 0; i < 2; ++i)
+			q.dispatch(more::qos::background, [&] { order += "B"; });
+		while (!q.empty())
+			q.run_once();
+	}
+	std::string run(more::dispatch_queue::starvation_limit, 'i');
+	std::string rest(40 - 2 * run.size(), 'i');
+	assert(order == std::string(10, 'i') + "B" + run + "B" + run + "B" + rest);
+
+	std::atomic<int> count(0);
+	{
+		more::dispatch_pool pool(2, more::qos::background);
+		for (int i = 0; i < 100; ++i)
+			pool.dispatch([&] { ++count; });
+	}
+	assert(count == 100);
+}
+
+void test_dispatch_after()
+{
+	printf("Testing dispatch_after and dispatch_every...\n");
+#if !MORE_DISPATCH_METRICS
+	// Queues that never use timers don't pay for the wheel.
+	assert(sizeof(more::dispatch_queue) < sizeof(more::detail::timer_wheel));
+#endif
+	typedef std::chrono::steady_clock clock;
+	std::string order;
+	std::atomic<int> late(0);
+	std::atomic<int> early(0);
+	std::atomic<int> ticks(0);
+	{
+		more::dispatch_thread t;
+		clock::time_point start = clock::now();
+		t.dispatch_after(std::chrono::milliseconds(30), [&] { order += "c"; });
+		t.dispatch_after(std::chrono::milliseconds(10), [&] { order += "a"; });
+		more::dispatch_after(t, start + std::chrono::milliseconds(20), [&] {
+			order += "b";
+		});
+		more::dispatch_after(t, start - std::chrono::seconds(1), [&] {
+			order += "!";
+		});
+
+		more::dispatch_timer cancelled = t.dispatch_after(
+			std::chrono::milliseconds(5), [&] { order += "x"; });
+		assert(cancelled.valid());
+		assert(cancelled.cancel());
+		assert(!cancelled.cancel());
+
+		// Enough timers, far enough out, to cascade through the wheel. None
+		// may fire before its deadline.
+		for (int i = 0; i < 1000; ++i) {
+			clock::time_point deadline =
+				start + std::chrono::milliseconds((i * 7919) % 300);
+			t.dispatch_after(deadline, [&, deadline] {
+				if (clock::now() < deadline) ++early;
+				++late;
+			});
+		}
+
+		more::dispatch_timer repeat = more::dispatch_every(
+			t, std::chrono::milliseconds(1), [&] { ++ticks; });
+		while (ticks < 5 || late < 1000)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		assert(repeat.cancel());
+		assert(!repeat.cancel());
+
+		more::dispatch_timer done;
+		{
+			std::atomic<bool> fired(false);
+			done = t.dispatch_after(clock::now(), [&] { fired = true; });
+			while (!fired)
+				std::this_thread::yield();
+		}
+		assert(!done.cancel());
+
+		// Timers still pending when the queue stops never fire.
+		t.dispatch_after(std::chrono::hours(1), [&] { order += "x"; });
+	}
+	printf(" order: %s, ticks: %d\n", order.c_str(), ticks.load());
+	assert(order == "!abc");
+	assert(early == 0);
+
+	more::dispatch_queue stopped;
+	stopped.stop();
+	assert(!stopped.dispatch_after(std::chrono::seconds(0), [] {}).valid());
+}
+
+void test_serial_queue()
+{
+	printf("Testing serial_queue...\n");
+	const int queues = 200;
+	const int blocks = 100;
+	std::atomic<int> overlaps(0);
+	std::atomic<int> out_of_order(0);
+	std::vector<int> next(queues, 0);
+	{
+		more::dispatch_pool pool(4);
+		std::vector<std::unique_ptr<std::atomic<bool>>> running;
+		std::vector<std::unique_ptr<more::serial_queue>> serial;
+		for (int q = 0; q < queues; ++q) {
+			serial.emplace_back(new more::serial_queue(pool));
+			running.emplace_back(new std::atomic<bool>(false));
+		}
+		for (int i = 0; i < blocks; ++i) {
+			for (int q = 0; q < queues; ++q) {
+				std::atomic<bool>& busy = *running[q];
+				int& n = next[q];
+				serial[q]->dispatch([&, i] {
+					if (busy.exchange(true)) ++overlaps;
+					if (n++ != i) ++out_of_order;
+					std::this_thread::yield();
+					busy = false;
+				});
+			}
+		}
+	}
+	printf(" overlaps: %d, out of order: %d\n", overlaps.load(),
+		out_of_order.load());
+	assert(overlaps == 0);
+	assert(out_of_order == 0);
+	for (int n : next)
+		assert(n == blocks);
+
+	// A serial_queue works with dispatch_async() too.
+	more::dispatch_pool pool(2);
+	more::serial_queue serial(pool);
+	assert(more::dispatch_async(serial, [] { return 7; }).get() == 7);
+}
+
+// Counts live copies of itself, to check that blocks release their captures.
+struct tracked
+{
+	static std::atomic<int> live;
+
+	tracked() { ++live; }
+	tracked(const tracked&) { ++live; }
+	~tracked() { --live; }
+};
+
+std::atomic<int> tracked::live(0);
+
+// Dispatches to a queue when it's destroyed, unless it's been moved from.
+template <typename Queue> struct redispatcher
+{
+	Queue* queue;
+
+	explicit redispatcher(Queue* queue) : queue(queue) {}
+	redispatcher(const redispatcher& other) : queue(other.queue) {}
+	redispatcher(redispatcher&& other) : queue(other.queue)
+	{
+		other.queue = nullptr;
+	}
+
+	~redispatcher()
+	{
+		if (queue) queue->dispatch([] {});
+	}
+};
+
+void test_bounded_queue()
+{
+	printf("Testing bounded queues...\n");
+	{
+		more::dispatch_queue q(2);
+		assert(q.capacity() == 2);
+		assert(q.try_dispatch([] {}));
+		assert(q.dispatch([] {}));
+		assert(!q.try_dispatch([] {}));
+		assert(!q.dispatch_for(std::chrono::milliseconds(1), [] {}));
+		q.run_once();
+		assert(q.try_dispatch([] {}));
+		q.stop();
+		q.run_forever();
+	}
+
+	// A producer that outpaces its consumer is held back.
+	std::atomic<int> count(0);
+	std::atomic<int> max_behind(0);
+	std::atomic<int> sent(0);
+	{
+		more::dispatch_thread t(size_t(4));
+		for (int i = 0; i < 1000; ++i) {
+			t.dispatch([&] { ++count; });
+			int behind = ++sent - count;
+			if (behind > max_behind) max_behind = behind;
+		}
+	}
+	printf(" most blocks in flight: %d\n", max_behind.load());
+	assert(count == 1000);
+	assert(max_behind <= 8);
+
+	// Dropping the oldest blocks keeps the newest.
+	std::string kept;
+	{
+		more::dispatch_queue q(3, more::overflow_policy::drop_oldest);
+		q.dispatch(more::qos::interactive, [&] { kept += "I"; });
+		for (char c = 'a'; c <= 'e'; ++c)
+			assert(q.try_dispatch([&, c] { kept += c; }));
+		assert(q.dropped() == 3);
+		q.stop();
+		q.run_forever();
+	}
+	printf(" kept: %s\n", kept.c_str());
+	assert(kept == "Ide");
+
+	// Dropped blocks are destroyed, along with their captures, even if the
+	// consumer never catches up.
+	{
+		tracked capture;
+		more::dispatch_queue q(100, more::overflow_policy::drop_oldest);
+		for (int i = 0; i < 100000; ++i) {
+			q.dispatch([capture] {});
+			assert(tracked::live <= 1 + 100);
+		}
+		assert(q.dropped() == 100000 - 100);
+		q.stop();
+		q.run_forever();
+	}
+	assert(tracked::live == 0);
+
+	// A refused block is destroyed without the queue's lock held, so its
+	// captures can dispatch to the same queue.
+	{
+		more::dispatch_queue q;
+		more::dispatch_pool pool(1);
+		redispatcher<more::dispatch_queue> to_queue(&q);
+		redispatcher<more::dispatch_pool> to_pool(&pool);
+		q.stop();
+		pool.stop();
+		assert(!q.dispatch([to_queue] {}));
+		assert(!pool.dispatch([to_pool] {}));
+	}
+
+	// And so is a dropped one.
+	{
+		more::dispatch_queue q(1, more::overflow_policy::drop_oldest);
+		redispatcher<more::dispatch_queue> to_queue(&q);
+		q.dispatch([to_queue] {});
+		q.dispatch([] {});
+		assert(q.dropped() >= 2);
+		q.stop();
+		q.run_forever();
+	}
+}
+
+void test_block_arena()
+{
+	printf("Testing block arenas...\n");
+	char big[256] = "big";
+	std::atomic<int> count(0);
+	more::arena_stats stats;
+	{
+		more::dispatch_queue q;
+		std::thread consumer([&] { q.run_forever(); });
+		for (int i = 0; i < 10000; ++i) {
+			q.dispatch([&, big] { count += big[0] == 'b'; });
+			if (i % 100 == 0) std::this_thread::yield();
+		}
+		q.stop();
+		q.wait_until_done();
+		consumer.join();
+		stats = q.arena_usage();
+	}
+	printf(
+		" allocations: %d, reserved: %d bytes\n",
+		int(stats.allocations),
+		int(stats.reserved));
+	assert(count == 10000);
+	assert(stats.allocations == 10000);
+	assert(stats.in_use == 0);
+	assert(stats.reserved < 10000 * 256);
+
+	// Blocks can be freed by any thread.
+	count = 0;
+	{
+		more::dispatch_pool pool(4);
+		for (int i = 0; i < 1000; ++i)
+			pool.dispatch([&, big] { count += big[1] == 'i'; });
+		while (count < 1000)
+			std::this_thread::yield();
+		assert(pool.arena_usage().allocations == 1000);
+	}
+}
+
+void test_block_relocation()
+{
+	printf("Testing dispatch_block relocation...\n");
+	typedef more::dispatch_block block;
+
+	int counter = 0;
+	auto pointer_only = [&counter] { ++counter; };
+	std::shared_ptr<std::string> name(new std::string("relocated"));
+	std::string result;
+	auto with_string = [&result, name] { result += *name; };
+	static_assert(
+		block::trivially_relocatable<decltype(pointer_only)>::value,
+		"pointer captures are moved with memcpy");
+	static_assert(
+		block::fits_inline<decltype(with_string)>::value
+			&& !block::trivially_relocatable<decltype(with_string)>::value,
+		"shared_ptr needs its move constructor");
+
+	// Grow the vector one block at a time, so blocks get moved many times.
+	std::vector<block> blocks;
+	for (int i = 0; i < 100; ++i) {
+		blocks.emplace_back(pointer_only);
+		blocks.emplace_back(with_string);
+	}
+	block moved = std::move(blocks.back());
+	blocks.back() = block(pointer_only);
+	moved.invoke_and_destroy();
+	for (auto& b : blocks)
+		b.invoke_and_destroy();
+	assert(counter == 101);
+	assert(result.size() == 100 * name->size());
+	assert(name.use_count() == 2); // name and with_string: none leaked.
+}
+
+void test_block_ownership()
+{
+	printf("Testing that blocks release their captures...\n");
+	tracked t;
+	assert(tracked::live == 1);
+
+	// Captures are released as soon as a block has run, not when its batch
+	// is cleared.
+	{
+		int released_before_next = -1;
+		more::dispatch_queue q;
+		q.dispatch([t] {});
+		q.dispatch([&] { released_before_next = tracked::live; });
+		q.dispatch([t] {});
+		q.stop();
+		q.run_forever();
+		assert(released_before_next == 2); // t, and the waiting block's.
+	}
+	assert(tracked::live == 1);
+
+	// Blocks that are moved around, rejected or never run release them too.
+	{
+		more::dispatch_queue q;
+		more::dispatch_batch batch;
+		for (int i = 0; i < 100; ++i)
+			batch.dispatch([t] {});
+		q.dispatch_bulk(batch);
+		q.stop();
+		assert(!q.dispatch([t] {}));
+		assert(!q.dispatch_after(std::chrono::seconds(0), [t] {}).valid());
+		q.run_forever();
+
+		more::dispatch_block block([t] {});
+		more::dispatch_block moved(std::move(block));
+		assert(!block && moved);
+		moved.reset();
+		assert(!moved);
+	}
+	assert(tracked::live == 1);
+
+	// And on every kind of queue.
+	{
+		more::ring_dispatch_thread ring(16);
+		more::dispatch_pool pool(2);
+		more::serial_queue serial(pool);
+		for (int i = 0; i < 100; ++i) {
+			ring.dispatch([t] {});
+			pool.dispatch([t] {});
+			serial.dispatch([t] {});
+		}
+	}
+	printf(" live: %d\n", tracked::live.load());
+	assert(tracked::live == 1);
+}
+
+void test_submission_cache()
+{
+	printf("Testing submission caches...\n");
+	std::atomic<int> count(0);
+	{
+		more::dispatch_thread t;
+		t.cache_submissions(16);
+		for (int i = 0; i < 100; ++i)
+			t.dispatch([&] { ++count; });
+		while (count < 96)
+			std::this_thread::yield();
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		assert(count == 96);
+		t.flush();
+		while (count < 100)
+			std::this_thread::yield();
+
+		// A producer's cache is flushed as soon as its own block is done.
+		more::dispatch_pool pool(1);
+		pool.dispatch([&] {
+			for (int i = 0; i < 10; ++i)
+				t.dispatch([&] { ++count; });
+		});
+		while (count < 110)
+			std::this_thread::yield();
+	}
+	printf(" count: %d\n", count.load());
+	assert(count == 110);
+
+	// Uncached dispatches flush the cache first, so blocks stay in order.
+	std::string order;
+	{
+		more::dispatch_queue q;
+		q.cache_submissions(100);
+		q.dispatch([&] { order += "a"; });
+		q.dispatch([&] { order += "b"; });
+		assert(q.empty());
+		q.try_dispatch([&] { order += "c"; });
+		q.dispatch([&] { order += "d"; });
+		q.flush();
+		q.stop();
+		q.run_forever();
+	}
+	assert(order == "abcd");
+
+	// Destroying a queue sends the calling thread's cached blocks first,
+	// and a stopped queue doesn't cache any more.
+	count = 0;
+	{
+		more::dispatch_thread t;
+		t.cache_submissions(64);
+		for (int i = 0; i < 100; ++i)
+			t.dispatch([&] { ++count; });
+	}
+	assert(count == 100);
+	{
+		more::dispatch_queue q;
+		q.cache_submissions(64);
+		q.dispatch([&] { ++count; });
+		q.stop();
+		assert(!q.dispatch([&] { ++count; }));
+		q.run_forever();
+	}
+	assert(count == 101);
+
+	// try_dispatch() doesn't wait for room for cached blocks, and nor does
+	// dispatch_for() beyond its timeout.
+	order.clear();
+	{
+		more::dispatch_queue q(2);
+		q.dispatch([&] { order += "a"; });
+		q.dispatch([&] { order += "b"; });
+		q.cache_submissions(100);
+		q.dispatch([&] { order += "c"; });
+		assert(!q.try_dispatch([&] { order += "x"; }));
+		assert(!q.dispatch_for(
+			std::chrono::milliseconds(1), [&] { order += "x"; }));
+		q.run_once();
+		assert(q.try_dispatch([&] { order += "d"; }));
+		q.stop();
+		q.run_forever();
+	}
+	assert(order == "abcd");
+
+	// stop() takes the blocks other threads still have cached, so they
+	// still run, and their caches turn down any more.
+	count = 0;
+	std::atomic<int> step(0);
+	{
+		more::dispatch_queue q;
+		q.cache_submissions(8);
+		std::thread producer([&] {
+			q.dispatch([&] { ++count; });
+			step = 1;
+			while (step != 2)
+				std::this_thread::yield();
+			assert(!q.dispatch([&] { ++count; }));
+		});
+		while (step != 1)
+			std::this_thread::yield();
+		q.stop();
+		q.run_forever();
+		assert(count == 1);
+		step = 2;
+		producer.join();
+	}
+	assert(count == 1);
+
+	// And so does the destructor.
+	step = 0;
+	std::thread producer;
+	{
+		more::dispatch_thread t;
+		t.cache_submissions(8);
+		producer = std::thread([&] {
+			t.dispatch([&] { ++count; });
+			step = 1;
+			while (step != 2)
+				std::this_thread::yield();
+		});
+		while (step != 1)
+			std::this_thread::yield();
+	}
+	assert(count == 2);
+	step = 2;
+	producer.join();
+}
+
+void test_thread_options()
+{
+	printf("Testing thread_options...\n");
+	more::thread_options options;
+	options.name = "more-io-thread";
+	options.cpus.push_back(0);
+	options.stack_size = 4 << 20;
+	options.policy = more::sched_policy::batch;
+	{
+		more::dispatch_thread t(options);
+#if defined(__linux__)
+		more::future<bool> applied = more::dispatch_async(t, [] {
+			char name[16];
+			pthread_getname_np(pthread_self(), name, sizeof(name));
+			pthread_attr_t attr;
+			size_t stack_size = 0;
+			pthread_getattr_np(pthread_self(), &attr);
+			pthread_attr_getstacksize(&attr, &stack_size);
+			pthread_attr_destroy(&attr);
+			return std::string(name) == "more-io-thread"
+				&& stack_size >= 4 << 20 && sched_getcpu() == 0
+				&& sched_getscheduler(0) == SCHED_BATCH;
+		});
+		assert(applied.get());
+#endif
+	}
+
+	// Options come before the queue's own arguments.
+	{
+		more::dispatch_thread bounded(options, size_t(4));
+		assert(bounded.queue().capacity() == 4);
+	}
+
+	std::atomic<int> count(0);
+	size_t nodes = more::numa_nodes().size();
+	{
+		more::dispatch_pool pool(more::numa_worker_options(4));
+		assert(pool.thread_count() == 4);
+		for (int i = 0; i < 1000; ++i)
+			pool.dispatch([&] { ++count; });
+	}
+	printf(" numa nodes: %d, count: %d\n", int(nodes), count.load());
+	assert(count == 1000);
+}
+
+#if MORE_DISPATCH_METRICS
+void test_metrics()
+{
+	printf("Testing metrics...\n");
+	typedef more::histogram_snapshot hs;
+	for (uint64_t v : { 0, 7, 8, 9, 15, 16, 1000, 123456789 }) {
+		size_t i = hs::bucket(v);
+		assert(hs::lower_bound(i) <= v && v <= hs::upper_bound(i));
+		assert(hs::upper_bound(i) - hs::lower_bound(i) <= v / 8);
+	}
+
+	more::dispatch_queue q;
+	for (int i = 0; i < 100; ++i)
+		q.dispatch([] {
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		});
+	more::queue_metrics m = q.metrics();
+	assert(m.enqueued == 100 && m.depth == 100 && m.max_depth == 100);
+	assert(m.lock_wait.count == 100 && m.lock_hold.count == 100);
+	assert(m.lock_wait.max == 0); // Nobody else wanted the lock.
+
+	q.stop();
+	q.run_forever();
+	m = q.metrics();
+	printf(
+		" depth: %d, max depth: %d, p50 run: %dus, p99 wait: %dus\n",
+		int(m.depth),
+		int(m.max_depth),
+		int(m.run.percentile(0.5) / 1000),
+		int(m.wait.percentile(0.99) / 1000));
+	assert(m.executed == 100 && m.depth == 0 && m.max_depth == 100);
+	assert(m.run.count == 100 && m.wait.count == 100);
+	assert(m.run.percentile(0.5) >= 100000 * 7 / 8);
+	assert(m.wait.max >= 99 * 100000);
+
+	std::string text = more::to_prometheus(m, "worker");
+	assert(text.find("worker_executed_total 100\n") != std::string::npos);
+	assert(text.find("worker_run_seconds_count 100\n") != std::string::npos);
+	assert(text.find("worker_wait_seconds_bucket{le=\"+Inf\"} 100\n")
+		   != std::string::npos);
+	assert(text.find("worker_lock_hold_seconds_count 100\n")
+		   != std::string::npos);
+
+	// Dropped blocks leave the depth, but never run.
+	more::dispatch_queue bounded(2, more::overflow_policy::drop_oldest);
+	for (int i = 0; i < 5; ++i)
+		bounded.dispatch([] {});
+	m = bounded.metrics();
+	assert(m.dropped == 3 && m.depth == 2 && m.max_depth == 2);
+	bounded.stop();
+	bounded.run_forever();
+	assert(bounded.metrics().executed == 2);
+}
+#endif
+
+#if MORE_DISPATCH_TRACING
+namespace
+{
+	std::atomic<int> hook_calls[3];
+	void count_dispatched(uint64_t) { ++hook_calls[0]; }
+	void count_started(uint64_t) { ++hook_calls[1]; }
+	void count_finished(uint64_t) { ++hook_calls[2]; }
+} // namespace
+
+static int count_of(const std::string& text, const std::string& pattern)
+{
+	int count = 0;
+	for (size_t i = text.find(pattern); i != std::string::npos;
+		 i = text.find(pattern, i + 1))
+		++count;
+	return count;
+}
+
+void test_tracing()
+{
+	printf("Testing tracing...\n");
+	std::atomic<int> count(0);
+	more::trace_sampling(1);
+	{
+		more::dispatch_thread thread;
+		thread.dispatch([&] { more::trace_thread_name("consumer \"1\""); });
+		for (int i = 0; i < 99; ++i)
+			thread.dispatch([&] { ++count; });
+	}
+
+	// One in every ten blocks traced.
+	more::trace_sampling(10);
+	{
+		more::dispatch_pool pool(2);
+		for (int i = 0; i < 100; ++i)
+			pool.dispatch([&] { ++count; });
+	}
+	more::trace_sampling(0);
+	{
+		more::dispatch_queue q;
+		q.dispatch([&] { ++count; });
+		q.stop();
+		q.run_forever();
+	}
+
+	FILE* file = tmpfile();
+	assert(file);
+	assert(more::write_chrome_trace(file));
+	std::string text(size_t(ftell(file)), '\0');
+	rewind(file);
+	assert(fread(&text[0], 1, text.size(), file) == text.size());
+	fclose(file);
+	int slices = count_of(text, "\"ph\":\"B\"");
+	int flows = count_of(text, "\"ph\":\"f\"");
+	printf(" blocks: %d, traced: %d, flows: %d\n", int(count), slices, flows);
+	assert(count == 200);
+	assert(slices == 110 && flows == 110);
+	assert(count_of(text, "\"ph\":\"E\"") == 110);
+	assert(text.find("\"name\":\"consumer \\\"1\\\"\"") != std::string::npos);
+
+	static const more::trace_hooks hooks = {
+		&count_dispatched, &count_started, &count_finished
+	};
+	more::set_trace_hooks(&hooks);
+	more::trace_sampling(1);
+	{
+		more::dispatch_thread thread;
+		for (int i = 0; i < 10; ++i)
+			thread.dispatch([&] { ++count; });
+	}
+	more::set_trace_hooks(nullptr);
+	assert(hook_calls[0] == 10 && hook_calls[1] == 10 && hook_calls[2] == 10);
+
+	// A traced block copies an lvalue functor, as an untraced one does.
+	std::string sizes;
+	{
+		more::dispatch_queue q;
+		std::string name = "name";
+		auto f = [&sizes, name] { sizes += std::to_string(name.size()); };
+		q.dispatch(f);
+		q.dispatch(f);
+		f();
+		q.stop();
+		q.run_forever();
+	}
+	more::trace_sampling(0);
+	assert(sizes == "444");
+}
+#endif
+
 int main(int argc, const char* argv[])
 {
 	test_dispatch_queue();
 	test_dispatch_thread();
 	test_infinite_recursion();
+	test_dispatch_pool();
+	test_heap_fallback();
+	test_block_relocation();
+	test_block_ownership();
+	test_ring_dispatch_queue();
+	test_run_once();
+	test_run_once_budget();
+#if defined(__linux__)
+	test_native_handle();
+#endif
+	test_idle_policy();
+	test_dispatch_bulk();
+	test_dispatch_apply();
+	test_fork_join();
+	test_pipeline();
+	test_futures();
+	test_dispatch_group();
+	test_cancellation();
+	test_qos();
+	test_dispatch_after();
+	test_serial_queue();
+	test_bounded_queue();
+	test_block_arena();
+	test_submission_cache();
+	test_thread_options();
+#if MORE_DISPATCH_METRICS
+	test_metrics();
+#endif
+#if MORE_DISPATCH_TRACING
+	test_tracing();
+#endif
 	return 0;
 }
@@ -0,0 +1,123 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "../include/more_dispatch/coroutine.h"
+
+template <typename Queue> std::thread::id thread_of(Queue& queue)
+{
+	return more::dispatch_async(queue, [] {
+			   return std::this_thread::get_id();
+		   })
+		.get();
+}
+
+more::task<int> add_on(more::dispatch_thread& thread, int a, int b)
+{
+	bool hopped = co_await thread.schedule();
+	assert(hopped);
+	co_return a + b;
+}
+
+more::task<std::string> hop_between(
+	more::dispatch_thread& a, more::dispatch_thread& b, int hops)
+{
+	std::thread::id a_id = thread_of(a);
+	std::thread::id b_id = thread_of(b);
+	for (int i = 0; i < hops; ++i) {
+		co_await a.schedule();
+		assert(std::this_thread::get_id() == a_id);
+		co_await b.schedule();
+		assert(std::this_thread::get_id() == b_id);
+	}
+	int sum = co_await add_on(a, 40, 2);
+	assert(std::this_thread::get_id() == a_id);
+	co_return "sum " + std::to_string(sum);
+}
+
+more::task<> fail_on(more::dispatch_pool& pool)
+{
+	co_await pool.schedule();
+	throw std::runtime_error("failed");
+}
+
+more::task<int> count_on(more::serial_queue& queue, int& count, int times)
+{
+	for (int i = 0; i < times; ++i) {
+		co_await queue.schedule();
+		++count;
+	}
+	co_return count;
+}
+
+void test_schedule()
+{
+	printf("Testing co_await schedule()...\n");
+	more::dispatch_thread a;
+	more::dispatch_thread b;
+	size_t heap = more::dispatch_block::heap_allocations();
+	std::string result = more::sync_wait(hop_between(a, b, 1000));
+	printf(" %s, heap allocations: %d\n", result.c_str(),
+		int(more::dispatch_block::heap_allocations() - heap));
+	assert(result == "sum 42");
+	assert(more::dispatch_block::heap_allocations() == heap);
+
+	// A stopped queue leaves the coroutine where it is.
+	more::dispatch_thread stopped;
+	stopped.stop();
+	auto stays = [&]() -> more::task<bool> {
+		co_return co_await stopped.schedule();
+	};
+	assert(!more::sync_wait(stays()));
+
+	more::dispatch_pool pool(2);
+	bool caught = false;
+	try {
+		more::sync_wait(fail_on(pool));
+	} catch (const std::runtime_error& e) {
+		caught = std::string(e.what()) == "failed";
+	}
+	assert(caught);
+
+	int count = 0;
+	more::serial_queue serial(pool);
+	assert(more::sync_wait(count_on(serial, count, 100)) == 100);
+}
+
+void test_tasks()
+{
+	printf("Testing task<T>...\n");
+	std::atomic<int> started(0);
+	auto lazy = [&]() -> more::task<int> {
+		++started;
+		co_return 7;
+	};
+	more::task<int> t = lazy();
+	assert(t.valid() && started == 0);
+	auto outer = [&](more::task<int> inner) -> more::task<int> {
+		int value = co_await inner;
+		co_return value * 6;
+	};
+	assert(more::sync_wait(outer(std::move(t))) == 42);
+	assert(started == 1 && !t.valid());
+
+	auto leaf = []() -> more::task<int> { co_return 1; };
+	auto loop = [&]() -> more::task<int> {
+		int sum = 0;
+		for (int i = 0; i < 1000; ++i)
+			sum += co_await leaf();
+		co_return sum;
+	};
+	assert(more::sync_wait(loop()) == 1000);
+}
+
+int main()
+{
+	test_schedule();
+	test_tasks();
+	return 0;
+}